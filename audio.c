@@ -1,170 +1,406 @@
 #include "audio.h"
 
+#include <SDL2/SDL.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "jobs.h"
 #include "lib/stb_vorbis.c"
+#include "mix.h"
 
+// Mono sounds are stored as they are, the mixer plays them on both channels
 typedef struct Sound {
-  short *samples;
-  int len_samples;
+  short *samples;  // interleaved if there are two channels
+  int len_frames;
+  int channels;  // 1 or 2
 } Sound;
 
-typedef struct {
-  short *start;
-  int cursor;
-  int size;  // in samples
-  u64 start_time;
-  SDL_AudioDeviceID audio_device_id;
-  double len_in_seconds;
-} AudioBuffer;
-
-typedef struct LoopedSound {
-  short *samples;
-  int len_bytes;
-  int read_cursor;
-} LoopedSound;
-
-typedef struct LoopedSounds {
-  LoopedSound sounds[10];
-  int num;
-} LoopedSounds;
-
-static LoopedSounds gLoopedSounds = {};
-
-// Both will be initialised by init_audio()
+// A sound being played. The callback mixes every active voice for exactly the frames the device
+// asks for, so nothing is mixed ahead of time.
+typedef struct Voice {
+  Sound *sound;
+  int position;  // in frames
+  u8 priority;   // kSoundPriorities of the sound
+  bool looped;
+  bool active;
+} Voice;
+
+typedef enum AudioCommandType {
+  AUDIO_PLAY,
+  AUDIO_PLAY_LOOPED,
+  AUDIO_STOP_LOOPED,
+} AudioCommandType;
+
+typedef struct AudioCommand {
+  AudioCommandType type;
+  SoundId sound_id;
+} AudioCommand;
+
+// Single producer (the main thread, or the simulation thread during gameplay), single consumer
+// (audio callback). Each side only writes its own index, the queue is empty when both are equal
+// and one slot is always left free.
+typedef struct AudioQueue {
+  AudioCommand commands[256];
+  SDL_atomic_t read;
+  SDL_atomic_t write;
+} AudioQueue;
+
+// Only touched by the audio callback
+static Voice gVoices[32];
+static int gVoiceLimit = COUNT(gVoices);  // voices in use, set before the callback starts
+
+static AudioQueue gQueue;
+
+// Will be initialised by add_sound_jobs()
 static Sound *gSounds;
-static AudioBuffer gBuffer;
-
-Sound *load_all_sounds() {
-  char *file_names[] = {
-      "sounds/bd1.ogg",       "sounds/stone.ogg",           "sounds/diamond_1.ogg",
-      "sounds/diamond_2.ogg", "sounds/diamond_3.ogg",       "sounds/diamond_4.ogg",
-      "sounds/diamond_5.ogg", "sounds/diamond_6.ogg",       "sounds/diamond_7.ogg",
-      "sounds/diamond_8.ogg", "sounds/diamond_collect.ogg", "sounds/walk_d.ogg",
-      "sounds/cover.ogg",     "sounds/finished.ogg",        "sounds/exploded.ogg",
-      "sounds/timeout_1.ogg", "sounds/timeout_2.ogg",       "sounds/timeout_3.ogg",
-      "sounds/timeout_4.ogg", "sounds/timeout_5.ogg",       "sounds/timeout_6.ogg",
-      "sounds/timeout_7.ogg", "sounds/timeout_8.ogg",       "sounds/timeout_9.ogg",
-      "sounds/crack.ogg",     "sounds/amoeba.ogg",          "sounds/walk_e.ogg",
-      "sounds/stone_2.ogg",   "sounds/magic_wall.ogg",
-  };
-
-  Sound *sounds = malloc(sizeof(Sound) * COUNT(file_names));
-
-  for (int i = 0; i < COUNT(file_names); ++i) {
-    Sound *sound = sounds + i;
-    char *file_name = file_names[i];
-
-    int channels;
-    int sample_rate;
-    sound->len_samples =
-        stb_vorbis_decode_filename(file_name, &channels, &sample_rate, &sound->samples);
-    if (channels == 1) {
-      // Make two channels out of one by duplicating each sample
-      short *new_samples = malloc(2 * sound->len_samples * sizeof(short));
-      for (int i = 0; i < sound->len_samples; ++i) {
-        short sample = sound->samples[i];
-        new_samples[2 * i] = sample;
-        new_samples[2 * i + 1] = sample;
-      }
-      sound->len_samples *= 2;
-      free(sound->samples);
-      sound->samples = new_samples;
+static bool gSoundsDecoded;  // not found in the cache, init_audio() writes a new one
+
+static char *kSoundFileNames[SOUND_COUNT] = {
+    "sounds/bd1.ogg",       "sounds/stone.ogg",           "sounds/diamond_1.ogg",
+    "sounds/diamond_2.ogg", "sounds/diamond_3.ogg",       "sounds/diamond_4.ogg",
+    "sounds/diamond_5.ogg", "sounds/diamond_6.ogg",       "sounds/diamond_7.ogg",
+    "sounds/diamond_8.ogg", "sounds/diamond_collect.ogg", "sounds/walk_d.ogg",
+    "sounds/cover.ogg",     "sounds/finished.ogg",        "sounds/exploded.ogg",
+    "sounds/timeout_1.ogg", "sounds/timeout_2.ogg",       "sounds/timeout_3.ogg",
+    "sounds/timeout_4.ogg", "sounds/timeout_5.ogg",       "sounds/timeout_6.ogg",
+    "sounds/timeout_7.ogg", "sounds/timeout_8.ogg",       "sounds/timeout_9.ogg",
+    "sounds/crack.ogg",     "sounds/amoeba.ogg",          "sounds/walk_e.ogg",
+    "sounds/stone_2.ogg",   "sounds/magic_wall.ogg",
+};
+
+// When every voice is busy a new sound takes the voice of a less important one. The music and
+// the events the player has to notice come first, the many rocks and diamonds of a busy cave last.
+static u8 kSoundPriorities[SOUND_COUNT] = {
+    3,  // SOUND_BD1
+    1,  // SOUND_STONE
+    1,  // SOUND_DIAMOND_1
+    1,  // SOUND_DIAMOND_2
+    1,  // SOUND_DIAMOND_3
+    1,  // SOUND_DIAMOND_4
+    1,  // SOUND_DIAMOND_5
+    1,  // SOUND_DIAMOND_6
+    1,  // SOUND_DIAMOND_7
+    1,  // SOUND_DIAMOND_8
+    2,  // SOUND_DIAMOND_COLLECT
+    1,  // SOUND_WALK_D
+    3,  // SOUND_COVER
+    3,  // SOUND_FINISHED
+    2,  // SOUND_EXPLODED
+    2,  // SOUND_TIMEOUT_1
+    2,  // SOUND_TIMEOUT_2
+    2,  // SOUND_TIMEOUT_3
+    2,  // SOUND_TIMEOUT_4
+    2,  // SOUND_TIMEOUT_5
+    2,  // SOUND_TIMEOUT_6
+    2,  // SOUND_TIMEOUT_7
+    2,  // SOUND_TIMEOUT_8
+    2,  // SOUND_TIMEOUT_9
+    2,  // SOUND_CRACK
+    2,  // SOUND_AMOEBA
+    1,  // SOUND_WALK_E
+    1,  // SOUND_STONE_2
+    2,  // SOUND_MAGIC_WALL
+};
+
+// ===== Sound cache =====
+// Decoding the Vorbis files takes most of the startup time. The first run writes the decoded
+// samples to one file, later runs map that file and point Sound.samples straight into it.
+//
+// File layout (native endian, the cache never leaves the machine that wrote it):
+//   SoundCacheHeader
+//   SoundCacheEntry entries[num_sounds]  indexed by SoundId
+//   short           samples              each sound at its entry's offset, 64-byte aligned
+
+typedef struct SoundCacheHeader {
+  char magic[4];  // "BDSC"
+  u32 version;
+  u32 num_sounds;
+  u32 padding;
+} SoundCacheHeader;
+
+typedef struct SoundCacheEntry {
+  u64 offset;  // in bytes from the start of the file
+  u32 len_frames;
+  u32 channels;
+  // Of the .ogg file the sound was decoded from, the cache is rebuilt when they change
+  u64 source_size;
+  u64 source_mtime;
+} SoundCacheEntry;
+
+const char *kSoundCacheFile = "sounds/cache.pcm";
+const u32 kSoundCacheVersion = 2;  // 2: mono sounds are stored as mono
+
+bool get_file_stamp(char *file_name, u64 *size, u64 *mtime) {
+  struct stat st;
+  if (stat(file_name, &st) != 0) return false;
+  *size = (u64)st.st_size;
+  *mtime = (u64)st.st_mtime;
+  return true;
+}
+
+// Returns false if there is no cache or it is out of date, sounds are left untouched then
+bool map_sound_cache(Sound *sounds, int num_sounds) {
+  int fd = open(kSoundCacheFile, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (u64)st.st_size < sizeof(SoundCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  u64 file_size = (u64)st.st_size;
+  u8 *data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // the mapping stays valid
+  if (data == MAP_FAILED) return false;
+
+  SoundCacheHeader *header = (SoundCacheHeader *)data;
+  SoundCacheEntry *entries = (SoundCacheEntry *)(header + 1);
+  bool ok = memcmp(header->magic, "BDSC", 4) == 0 && header->version == kSoundCacheVersion &&
+            header->num_sounds == num_sounds &&
+            sizeof(*header) + num_sounds * sizeof(*entries) <= file_size;
+  for (int i = 0; ok && i < num_sounds; i++) {
+    SoundCacheEntry *entry = &entries[i];
+    u64 size, mtime;
+    ok = get_file_stamp(kSoundFileNames[i], &size, &mtime) && entry->source_size == size &&
+         entry->source_mtime == mtime && entry->offset % sizeof(short) == 0 &&
+         (entry->channels == 1 || entry->channels == 2) &&
+         entry->offset + (u64)entry->len_frames * entry->channels * sizeof(short) <= file_size;
+  }
+  if (!ok) {
+    munmap(data, file_size);
+    return false;
+  }
+
+  // The mapping is never unmapped, the sounds are used until the game quits
+  for (int i = 0; i < num_sounds; i++) {
+    sounds[i].samples = (short *)(data + entries[i].offset);
+    sounds[i].len_frames = entries[i].len_frames;
+    sounds[i].channels = entries[i].channels;
+  }
+  return true;
+}
+
+// Written to a temporary file first, so that a crash never leaves a broken cache behind
+bool save_sound_cache(Sound *sounds, int num_sounds) {
+  char temp_file[256];
+  snprintf(temp_file, sizeof(temp_file), "%s.tmp", kSoundCacheFile);
+  FILE *file = fopen(temp_file, "wb");
+  if (file == NULL) {
+    printf("Couldn't open %s for writing\n", temp_file);
+    return false;
+  }
+
+  SoundCacheHeader header = {};
+  memcpy(header.magic, "BDSC", 4);
+  header.version = kSoundCacheVersion;
+  header.num_sounds = num_sounds;
+
+  SoundCacheEntry *entries = calloc(num_sounds, sizeof(*entries));
+  u64 offset = sizeof(header) + num_sounds * sizeof(*entries);
+  bool ok = true;
+  for (int i = 0; i < num_sounds; i++) {
+    offset = (offset + 63) & ~(u64)63;
+    entries[i].offset = offset;
+    entries[i].len_frames = sounds[i].len_frames;
+    entries[i].channels = sounds[i].channels;
+    ok = ok && get_file_stamp(kSoundFileNames[i], &entries[i].source_size,
+                              &entries[i].source_mtime);
+    offset += (u64)sounds[i].len_frames * sounds[i].channels * sizeof(short);
+  }
+
+  static const u8 kZeros[64];
+  ok = ok && fwrite(&header, sizeof(header), 1, file) == 1 &&
+       fwrite(entries, sizeof(*entries), num_sounds, file) == num_sounds;
+  for (int i = 0; ok && i < num_sounds; i++) {
+    u64 padding = entries[i].offset - (u64)ftell(file);
+    u64 len_samples = (u64)sounds[i].len_frames * sounds[i].channels;
+    ok = fwrite(kZeros, 1, padding, file) == padding &&
+         fwrite(sounds[i].samples, sizeof(short), len_samples, file) == len_samples;
+  }
+  ok = fclose(file) == 0 && ok;
+  free(entries);
+
+  if (ok) ok = rename(temp_file, kSoundCacheFile) == 0;
+  if (!ok) {
+    printf("Couldn't write sound cache %s\n", kSoundCacheFile);
+    remove(temp_file);
+  }
+  return ok;
+}
+
+// ===== Loading =====
+
+void decode_sound(Sound *sound, char *file_name) {
+  int sample_rate;
+  sound->len_frames =
+      stb_vorbis_decode_filename(file_name, &sound->channels, &sample_rate, &sound->samples);
+  assert(sound->channels == 1 || sound->channels == 2);
+  assert(sample_rate == 44100);  // samples in 1 sec
+}
+
+void decode_sound_job(void *data) {
+  Sound *sound = data;
+  decode_sound(sound, kSoundFileNames[sound - gSounds]);
+}
+
+void add_sound_jobs(JobBatch *batch) {
+  gSounds = malloc(sizeof(Sound) * COUNT(kSoundFileNames));
+  if (map_sound_cache(gSounds, COUNT(kSoundFileNames))) {
+    return;
+  }
+
+  gSoundsDecoded = true;
+  for (int i = 0; i < COUNT(kSoundFileNames); ++i) {
+    add_job(batch, decode_sound_job, &gSounds[i]);
+  }
+}
+
+static inline int frames_left(Voice *voice) {
+  return voice->sound->len_frames - voice->position;
+}
+
+// Returns NULL if every voice plays something at least as important
+Voice *find_voice(u8 priority) {
+  Voice *result = NULL;
+  for (int i = 0; i < gVoiceLimit; i++) {
+    Voice *voice = &gVoices[i];
+    if (!voice->active) return voice;
+
+    // Of the least important voices, take the one with the fewest frames left to play
+    if (voice->priority < priority &&
+        (result == NULL || voice->priority < result->priority ||
+         (voice->priority == result->priority && frames_left(voice) < frames_left(result)))) {
+      result = voice;
     }
-    assert(channels <= 2);
-    assert(sample_rate == 44100);  // samples in 1 sec
   }
+  return result;
+}
+
+void run_audio_command(AudioCommand *command) {
+  switch (command->type) {
+    case AUDIO_PLAY:
+    case AUDIO_PLAY_LOOPED: {
+      u8 priority = kSoundPriorities[command->sound_id];
+      Voice *voice = find_voice(priority);
+      if (voice == NULL) break;  // the sound is dropped
 
-  return sounds;
+      voice->sound = &gSounds[command->sound_id];
+      voice->position = 0;
+      voice->priority = priority;
+      voice->looped = command->type == AUDIO_PLAY_LOOPED;
+      voice->active = true;
+    } break;
+    case AUDIO_STOP_LOOPED: {
+      for (int i = 0; i < COUNT(gVoices); i++) {
+        if (gVoices[i].looped) {
+          gVoices[i].active = false;
+        }
+      }
+    } break;
+  }
 }
 
 void audio_callback(void *userdata, u8 *stream, int len) {
-  AudioBuffer *buffer = &gBuffer;
-  assert((buffer->size * sizeof(short)) % len == 0);
-  if (buffer->start_time == 0) {
-    buffer->start_time = time_now();  // for the first call
-  }
-
-  // Copy the data from the single-sound buffer
-  SDL_memcpy(stream, buffer->start + buffer->cursor, len);
-  SDL_memset(buffer->start + buffer->cursor, 0, len);
-
-  // Mix in any looped sounds currently being played
-  for (int i = 0; i < gLoopedSounds.num; i++) {
-    LoopedSound *sound = &gLoopedSounds.sounds[i];
-    assert(sound->len_bytes >= len);  // we don't support short sounds for loops
-
-    u8 *src = (u8 *)sound->samples + sound->read_cursor;
-
-    if (sound->read_cursor + len <= sound->len_bytes) {
-      // No wrapping needed
-      SDL_MixAudioFormat(stream, src, AUDIO_S16, len, SDL_MIX_MAXVOLUME / 2);
-    } else {
-      // Need to wrap and copy in 2 chunks
-      int chunk1 = sound->len_bytes - sound->read_cursor;
-      int chunk2 = len - chunk1;
-      SDL_MixAudioFormat(stream, src, AUDIO_S16, chunk1, SDL_MIX_MAXVOLUME / 2);
-      SDL_MixAudioFormat(stream + chunk1, (u8 *)sound->samples, AUDIO_S16, chunk2,
-                         SDL_MIX_MAXVOLUME / 2);
+  // Run the commands sent since the last call. They all start at the same frame, so a one-shot
+  // sound asked for several times (by several ticks) is only played once.
+  int read = SDL_AtomicGet(&gQueue.read);
+  int write = SDL_AtomicGet(&gQueue.write);
+  SDL_MemoryBarrierAcquire();  // the commands up to write are complete
+  u64 started = 0;  // bit per SoundId
+  while (read != write) {
+    AudioCommand *command = &gQueue.commands[read];
+    u64 bit = (u64)1 << command->sound_id;
+    if (command->type != AUDIO_PLAY || !(started & bit)) {
+      run_audio_command(command);
     }
-    sound->read_cursor = (sound->read_cursor + len) % sound->len_bytes;
+    if (command->type == AUDIO_PLAY) {
+      started |= bit;
+    }
+    read = (read + 1) % COUNT(gQueue.commands);
   }
+  SDL_MemoryBarrierRelease();  // done reading the commands before handing their slots back
+  SDL_AtomicSet(&gQueue.read, read);
+
+  SDL_memset(stream, 0, len);
+  short *output = (short *)stream;
+  int len_frames = len / (2 * sizeof(short));
+
+  for (int i = 0; i < COUNT(gVoices); i++) {
+    Voice *voice = &gVoices[i];
+    if (!voice->active) continue;
+
+    int volume = voice->looped ? MIX_MAX_VOLUME / 2 : MIX_MAX_VOLUME;
+    Sound *sound = voice->sound;
+    int mixed = 0;  // in frames
+    while (mixed < len_frames) {
+      int chunk = sound->len_frames - voice->position;
+      if (chunk > len_frames - mixed) {
+        chunk = len_frames - mixed;
+      }
+      mix_samples(output + 2 * mixed, sound->samples + voice->position * sound->channels, chunk,
+                  sound->channels, volume);
+      mixed += chunk;
+      voice->position += chunk;
 
-  buffer->cursor += len / sizeof(short);
-  buffer->cursor %= buffer->size;
+      if (voice->position == sound->len_frames) {
+        if (!voice->looped) {
+          voice->active = false;
+          break;
+        }
+        voice->position = 0;
+      }
+    }
+  }
 }
+
+// Never blocks. If the audio thread has fallen behind and the queue is full the command is dropped.
+void send_audio_command(AudioCommandType type, SoundId sound_id) {
+  int write = SDL_AtomicGet(&gQueue.write);
+  int next_write = (write + 1) % COUNT(gQueue.commands);
+  if (next_write == SDL_AtomicGet(&gQueue.read)) {
+    return;
+  }
+  SDL_MemoryBarrierAcquire();  // the callback is done with the slot
+
+  AudioCommand *command = &gQueue.commands[write];
+  command->type = type;
+  command->sound_id = sound_id;
+  SDL_MemoryBarrierRelease();  // the command has to be visible before the new write index
+  SDL_AtomicSet(&gQueue.write, next_write);
+}
+
+void set_voice_limit(int num_voices) {
+  if (num_voices < 1) num_voices = 1;
+  if (num_voices > COUNT(gVoices)) num_voices = COUNT(gVoices);
+  gVoiceLimit = num_voices;
+}
+
 void play_sound(SoundId sound_id) {
-  AudioBuffer *buffer = &gBuffer;
-  Sound sound = gSounds[sound_id];
-
-  SDL_LockAudioDevice(buffer->audio_device_id);
-  // Calculate the write cursor based on how much time has passed relatively to
-  // the first audio_callback call
-  double buffers_passed = seconds_since(buffer->start_time) / buffer->len_in_seconds;
-  double whole_buffers;
-  int write_cursor = (int)((modf(buffers_passed, &whole_buffers)) * (double)(buffer->size));
-  write_cursor += 10000;  // experimentally obtained to put the write cursor ahead the buffer cursor
-  write_cursor %= buffer->size;
-
-  if (write_cursor + sound.len_samples > buffer->size) {
-    int chunk1_len_samples = buffer->size - write_cursor;
-    int chunk2_len_samples = sound.len_samples - chunk1_len_samples;
-    SDL_MixAudioFormat((u8 *)(buffer->start + write_cursor), (u8 *)sound.samples, AUDIO_S16,
-                       chunk1_len_samples * sizeof(short), SDL_MIX_MAXVOLUME);
-    SDL_MixAudioFormat((u8 *)buffer->start, (u8 *)(sound.samples + chunk1_len_samples), AUDIO_S16,
-                       chunk2_len_samples * sizeof(short), SDL_MIX_MAXVOLUME);
-  } else {
-    SDL_MixAudioFormat((u8 *)(buffer->start + write_cursor), (u8 *)sound.samples, AUDIO_S16,
-                       sound.len_samples * sizeof(short), SDL_MIX_MAXVOLUME);
-  }
-  SDL_UnlockAudioDevice(buffer->audio_device_id);
+  send_audio_command(AUDIO_PLAY, sound_id);
 }
 
 void play_looped_sound(SoundId sound_id) {
-  Sound sound = gSounds[sound_id];
-  LoopedSound lSound;
-  lSound.samples = sound.samples;
-  lSound.len_bytes = sound.len_samples * sizeof(short);
-  lSound.read_cursor = 0;
-  gLoopedSounds.sounds[gLoopedSounds.num] = lSound;
-  gLoopedSounds.num++;
+  send_audio_command(AUDIO_PLAY_LOOPED, sound_id);
 }
 
 void stop_looped_sounds() {
-  gLoopedSounds.num = 0;
+  send_audio_command(AUDIO_STOP_LOOPED, 0);
 }
 
 // Returns audiodevice id on success, returns 0 on error
 SDL_AudioDeviceID init_audio() {
-  gSounds = load_all_sounds();
+  if (gSoundsDecoded) {
+    save_sound_cache(gSounds, COUNT(kSoundFileNames));
+  }
 
   const int kFrequency = 44100;  // Sample frames per second (sample_rate)
   const int kChannels = 2;
   const int kCallbackSampleFrames = 2048;
-  const int kCallbackBuffersPerMinute =
-      (int)(((double)kFrequency / (double)(kCallbackSampleFrames * kChannels)) *
-            60.0);  // approximately
 
   // Create audio device
   SDL_AudioSpec desired_audiospec = {};
@@ -182,16 +418,6 @@ SDL_AudioDeviceID init_audio() {
     return 0;
   }
 
-  // Init buffer
-  gBuffer.size =
-      kCallbackBuffersPerMinute * kCallbackSampleFrames * kChannels;  // enough samples for a minute
-  gBuffer.start = malloc(gBuffer.size * sizeof(short));
-  SDL_memset(gBuffer.start, 0, gBuffer.size);
-  gBuffer.cursor = 0;
-  gBuffer.len_in_seconds = (double)gBuffer.size / (double)(kFrequency * kChannels);
-  gBuffer.start_time = 0;  // invalid time, will be replaced by audio_callback()
-  gBuffer.audio_device_id = audio_device_id;
-
   SDL_PauseAudioDevice(audio_device_id, 0);
 
   return audio_device_id;
@@ -0,0 +1,119 @@
+// Simulation microbenchmark. Runs every cave with a fixed input script and times each subsystem
+// of sim_step(). Results go to stdout as CSV, one row per cave and subsystem:
+//
+//   cave,subsystem,calls,ns_per_tick,min_ns,median_ns,p99_ns
+//
+// ns_per_tick is the total time spent in the subsystem divided by the number of ticks simulated,
+// min/median/p99 are taken over the individual calls. The "tick" subsystem is the whole
+// sim_step() call.
+//
+// Usage: boulder-dash-bench [ticks] [physics]
+//
+//   physics  "awake" (default), "bitboard" or "loop", selects the rock and diamond physics
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+
+typedef struct Samples {
+  u32 *ns;
+  int num;
+} Samples;
+
+// One extra slot for the whole tick
+static Samples gSamples[SUBSYSTEM_COUNT + 1];
+
+char *gSubsystemNames[SUBSYSTEM_COUNT + 1] = {
+    "player", "flooding", "enemies", "drop", "explosions", "tick",
+};
+
+u64 sim_profile_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+void sim_profile_record(SimSubsystem subsystem, u64 ns) {
+  Samples *samples = &gSamples[subsystem];
+  samples->ns[samples->num++] = (u32)ns;
+}
+
+// Walk around in a square, with a pause at the end so that objects have time to settle
+Input script_input(int tick) {
+  Input input = {};
+  int step = (tick / 40) % 5;
+  input.right = step == 0;
+  input.down = step == 1;
+  input.left = step == 2;
+  input.up = step == 3;
+  return input;
+}
+
+int compare_u32(const void *a, const void *b) {
+  u32 x = *(u32 *)a;
+  u32 y = *(u32 *)b;
+  return (x > y) - (x < y);
+}
+
+void report(int cave, int subsystem, int num_ticks) {
+  Samples *samples = &gSamples[subsystem];
+  u64 total = 0;
+  for (int i = 0; i < samples->num; i++) {
+    total += samples->ns[i];
+  }
+
+  u32 min = 0, median = 0, p99 = 0;
+  if (samples->num > 0) {
+    qsort(samples->ns, samples->num, sizeof(*samples->ns), compare_u32);
+    min = samples->ns[0];
+    median = samples->ns[samples->num / 2];
+    p99 = samples->ns[(int)((samples->num - 1) * 0.99)];
+  }
+  printf("%d,%s,%d,%.1f,%u,%u,%u\n", cave, gSubsystemNames[subsystem], samples->num,
+         (double)total / num_ticks, min, median, p99);
+}
+
+int main(int argc, char **argv) {
+  int num_ticks = 20000;
+  if (argc > 1) num_ticks = atoi(argv[1]);
+  if (num_ticks <= 0) return 1;
+  if (argc > 2) {
+    if (strcmp(argv[2], "loop") == 0) gPhysics = PHYSICS_LOOP;
+    if (strcmp(argv[2], "bitboard") == 0) gPhysics = PHYSICS_BITBOARD;
+  }
+
+  for (int i = 0; i < COUNT(gSamples); i++) {
+    gSamples[i].ns = malloc(num_ticks * sizeof(u32));
+  }
+
+  printf("cave,subsystem,calls,ns_per_tick,min_ns,median_ns,p99_ns\n");
+
+  static Level level;
+  for (int cave = 0; cave < COUNT(gLevels); cave++) {
+    for (int i = 0; i < COUNT(gSamples); i++) {
+      gSamples[i].num = 0;
+    }
+
+    load_level(&level, cave);
+    sim_start_level(&level);
+    for (int tick = 0; tick < num_ticks; tick++) {
+      SimEvents events = {};
+      u64 start = sim_profile_now();
+      SimOutcome outcome = sim_step(&level, script_input(level.tick), &events);
+      sim_profile_record(SUBSYSTEM_COUNT, sim_profile_now() - start);
+
+      if (outcome != SIM_RUNNING) {
+        load_level(&level, cave);  // keep going from the start of the cave
+        sim_start_level(&level);
+      }
+    }
+
+    for (int i = 0; i < COUNT(gSamples); i++) {
+      report(cave, i, num_ticks);
+    }
+  }
+  return 0;
+}
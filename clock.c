@@ -0,0 +1,45 @@
+#include "clock.h"
+
+#include <stddef.h>
+
+void clock_start(FrameClock *clock, ClockSource *source, u64 frequency) {
+  clock->source = source;
+  clock->frequency = frequency;
+  clock->step = 0;
+  clock->now = source();
+  clock->dt = 0;
+}
+
+void clock_start_virtual(FrameClock *clock, double frame_seconds) {
+  clock->source = NULL;
+  clock->frequency = 1000000000;  // nanoseconds
+  clock->step = clock_ticks(clock, frame_seconds);
+  clock->now = 0;
+  clock->dt = 0;
+}
+
+bool clock_is_virtual(FrameClock *clock) {
+  return clock->source == NULL;
+}
+
+u64 clock_read(FrameClock *clock) {
+  return clock->source ? clock->source() : clock->now;
+}
+
+void clock_tick(FrameClock *clock) {
+  u64 now = clock->source ? clock->source() : clock->now + clock->step;
+  clock->dt = clock_seconds(clock, now - clock->now);
+  clock->now = now;
+}
+
+void clock_skip(FrameClock *clock) {
+  clock->now = clock_read(clock);
+}
+
+u64 clock_ticks(FrameClock *clock, double seconds) {
+  return (u64)(seconds * clock->frequency);
+}
+
+double clock_seconds(FrameClock *clock, u64 ticks) {
+  return (double)ticks / clock->frequency;
+}
@@ -0,0 +1,295 @@
+// Runs caves without video or audio, as fast as the CPU allows.
+//
+// Usage: boulder-dash-headless [level] [ticks] [script] [record]
+//        boulder-dash-headless --replay <file> [seek]
+//        boulder-dash-headless --check-physics [ticks] [script]
+//
+//   level   cave to run (0..19), or -1 for all of them (default)
+//   ticks   number of simulation ticks per cave (default 10000)
+//   script  input script file; without one the player stands still
+//   record  save the first attempt of the cave as a replay
+//
+// With --replay the recorded attempt is played back and every tick is checked against the tiles
+// that were recorded. Given a seek tick it instead jumps straight to that tick using the replay's
+// keyframes.
+//
+// With --check-physics every cave is stepped once per Physics implementation with the same input,
+// and the tiles, outcome and SimEvents have to be the same after every tick.
+//
+// The script is a list of "<ticks> <keys>" lines, where keys is any combination of 'r', 'l', 'u',
+// 'd' (arrows) and 'c' (Ctrl), or '-' for no keys. The script is repeated until the cave runs out
+// of ticks. When the player dies, wins or runs out of time the cave is restarted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "replay.h"
+#include "sim.h"
+
+typedef struct ScriptStep {
+  Input input;
+  int ticks;
+} ScriptStep;
+
+typedef struct Script {
+  ScriptStep steps[1024];
+  int num;
+} Script;
+
+bool load_script(Script *script, char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL) {
+    printf("Couldn't open script %s\n", file_name);
+    return false;
+  }
+
+  int ticks;
+  char keys[16];
+  while (script->num < COUNT(script->steps) && fscanf(file, "%d %15s", &ticks, keys) == 2) {
+    ScriptStep *step = &script->steps[script->num++];
+    memset(step, 0, sizeof(*step));
+    step->ticks = ticks;
+    step->input.right = strchr(keys, 'r') != NULL;
+    step->input.left = strchr(keys, 'l') != NULL;
+    step->input.up = strchr(keys, 'u') != NULL;
+    step->input.down = strchr(keys, 'd') != NULL;
+    step->input.pickup = strchr(keys, 'c') != NULL;
+  }
+  fclose(file);
+  return true;
+}
+
+Input script_input(Script *script, int tick) {
+  Input input = {};
+  if (script->num == 0) return input;
+
+  int total_ticks = 0;
+  for (int i = 0; i < script->num; i++) {
+    total_ticks += script->steps[i].ticks;
+  }
+  if (total_ticks <= 0) return input;
+
+  tick %= total_ticks;
+  for (int i = 0; i < script->num; i++) {
+    if (tick < script->steps[i].ticks) {
+      return script->steps[i].input;
+    }
+    tick -= script->steps[i].ticks;
+  }
+  return input;
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void run_level(int level_id, int num_ticks, Script *script, Replay *replay) {
+  static Level level;
+  load_level(&level, level_id);
+  sim_start_level(&level);
+  bool recording = replay != NULL;
+  if (recording) {
+    replay_start(replay, level_id, 0, &level);
+  }
+
+  int restarts = 0;
+  int deaths = 0;
+  int wins = 0;
+  int sounds = 0;
+
+  double start = now_seconds();
+  for (int tick = 0; tick < num_ticks; tick++) {
+    Input input = script_input(script, level.tick);
+    SimEvents events = {};
+    SimOutcome outcome = sim_step(&level, input, &events);
+    sounds += events.num_sounds;
+    if (recording) {
+      replay_record(replay, input, &level);
+    }
+
+    if (outcome != SIM_RUNNING) {
+      recording = false;
+      if (outcome == SIM_PLAYER_DIED) deaths++;
+      if (outcome == SIM_LEVEL_COMPLETE) wins++;
+      restarts++;
+      load_level(&level, level_id);
+      sim_start_level(&level);
+    }
+  }
+  double elapsed = now_seconds() - start;
+
+  printf("level %2d: %d ticks, %d restarts (%d deaths, %d wins), %d sounds, tiles %08x, ",
+         level_id, num_ticks, restarts, deaths, wins, sounds, hash_tiles(level.tiles));
+  printf("%.1f ns/tick\n", elapsed * 1e9 / num_ticks);
+}
+
+// Returns false if the replay doesn't reproduce
+bool play_replay(char *file_name) {
+  Replay replay = {};
+  if (!replay_load(&replay, file_name)) {
+    return false;
+  }
+
+  static Level level;
+  replay_seek(&replay, &level, 0);
+
+  bool ok = true;
+  double start = now_seconds();
+  while (level.tick < replay.num_ticks) {
+    int tick = level.tick;
+    SimEvents events = {};
+    sim_step(&level, replay_input(&replay, tick), &events);
+    if (!replay_check(&replay, tick, &level)) {
+      printf("replay diverged at tick %d\n", tick);
+      ok = false;
+      break;
+    }
+  }
+  double elapsed = now_seconds() - start;
+
+  if (ok) {
+    printf("level %2d: %d ticks replayed, tiles %08x, %.1f ns/tick\n", replay.level_id,
+           replay.num_ticks, hash_tiles(level.tiles), elapsed * 1e9 / replay.num_ticks);
+  }
+  replay_free(&replay);
+  return ok;
+}
+
+// Returns false if the state at the tick doesn't match the recording
+bool seek_replay(char *file_name, int tick) {
+  Replay replay = {};
+  if (!replay_load(&replay, file_name)) {
+    return false;
+  }
+
+  static Level level;
+  double start = now_seconds();
+  bool ok = replay_seek(&replay, &level, tick);
+  double elapsed = now_seconds() - start;
+
+  if (!ok) {
+    printf("replay has only %d ticks\n", replay.num_ticks);
+  } else if (tick > 0 && !replay_check(&replay, tick - 1, &level)) {
+    printf("seek to tick %d doesn't match the recording\n", tick);
+    ok = false;
+  } else {
+    printf("level %2d: seek to tick %d, tiles %08x, %.3f ms\n", replay.level_id, tick,
+           hash_tiles(level.tiles), elapsed * 1e3);
+  }
+  replay_free(&replay);
+  return ok;
+}
+
+// The audio doesn't care in which order the sounds of a tick were asked for
+u64 sound_bits(SoundId *sounds, int num) {
+  u64 bits = 0;
+  for (int i = 0; i < num; i++) {
+    bits |= (u64)1 << sounds[i];
+  }
+  return bits;
+}
+
+bool same_events(SimEvents *a, SimEvents *b) {
+  return sound_bits(a->sounds, a->num_sounds) == sound_bits(b->sounds, b->num_sounds) &&
+         sound_bits(a->looped_sounds, a->num_looped_sounds) ==
+             sound_bits(b->looped_sounds, b->num_looped_sounds) &&
+         a->stop_looped_sounds == b->stop_looped_sounds && a->score == b->score &&
+         a->white_tunnel == b->white_tunnel;
+}
+
+// Returns false at the first tick where an implementation differs from PHYSICS_LOOP
+bool check_physics(int level_id, int num_ticks, Script *script) {
+  static Physics physics[] = {PHYSICS_LOOP, PHYSICS_BITBOARD, PHYSICS_ACTIVE_SET};
+  static char *names[] = {"loop", "bitboard", "active set"};
+  static Level levels[COUNT(physics)];
+  for (int i = 0; i < COUNT(physics); i++) {
+    load_level(&levels[i], level_id);
+    sim_start_level(&levels[i]);
+  }
+
+  Physics saved = gPhysics;
+  bool ok = true;
+  int restarts = 0;
+  for (int tick = 0; tick < num_ticks && ok; tick++) {
+    Input input = script_input(script, levels[0].tick);
+    SimEvents events[COUNT(physics)] = {};
+    SimOutcome outcomes[COUNT(physics)];
+    for (int i = 0; i < COUNT(physics); i++) {
+      gPhysics = physics[i];
+      outcomes[i] = sim_step(&levels[i], input, &events[i]);
+    }
+
+    for (int i = 1; i < COUNT(physics) && ok; i++) {
+      if (memcmp(levels[i].tiles, levels[0].tiles, sizeof(Tiles)) != 0 ||
+          outcomes[i] != outcomes[0] || !same_events(&events[i], &events[0])) {
+        printf("level %2d: %s differs from loop at tick %d after %d restarts\n", level_id,
+               names[i], levels[0].tick - 1, restarts);
+        ok = false;
+      }
+    }
+
+    if (outcomes[0] != SIM_RUNNING) {
+      restarts++;
+      for (int i = 0; i < COUNT(physics); i++) {
+        load_level(&levels[i], level_id);
+        sim_start_level(&levels[i]);
+      }
+    }
+  }
+  gPhysics = saved;
+
+  if (ok) {
+    printf("level %2d: %d ticks, %d restarts, all physics match\n", level_id, num_ticks,
+           restarts);
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  int level_id = -1;
+  int num_ticks = 10000;
+  static Script script;
+  Replay replay = {};
+  char *replay_file = NULL;
+
+  if (argc > 3 && strcmp(argv[1], "--replay") == 0) {
+    return seek_replay(argv[2], atoi(argv[3])) ? 0 : 1;
+  }
+  if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+    return play_replay(argv[2]) ? 0 : 1;
+  }
+  if (argc > 1 && strcmp(argv[1], "--check-physics") == 0) {
+    if (argc > 2) num_ticks = atoi(argv[2]);
+    if (argc > 3 && !load_script(&script, argv[3])) return 1;
+
+    bool ok = true;
+    for (int i = 0; i < COUNT(gLevels); i++) {
+      ok = check_physics(i, num_ticks, &script) && ok;
+    }
+    return ok ? 0 : 1;
+  }
+
+  if (argc > 1) level_id = atoi(argv[1]);
+  if (argc > 2) num_ticks = atoi(argv[2]);
+  if (argc > 3 && !load_script(&script, argv[3])) return 1;
+  if (argc > 4) replay_file = argv[4];
+
+  if (level_id >= (int)COUNT(gLevels)) {
+    printf("No such level %d\n", level_id);
+    return 1;
+  }
+
+  if (level_id >= 0) {
+    run_level(level_id, num_ticks, &script, replay_file ? &replay : NULL);
+    if (replay_file && !replay_save(&replay, replay_file)) return 1;
+  } else {
+    for (int i = 0; i < COUNT(gLevels); i++) {
+      run_level(i, num_ticks, &script, NULL);
+    }
+  }
+  return 0;
+}
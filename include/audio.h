@@ -33,9 +33,19 @@ typedef enum SoundId {
   SOUND_WALK_E,
   SOUND_STONE_2,
   SOUND_MAGIC_WALL,
+
+  SOUND_COUNT
 } SoundId;
 
-SDL_AudioDeviceID init_audio();
+struct JobBatch;
+
+// Queues decoding of the sounds that aren't in the sound cache. init_audio() has to wait until the
+// batch is finished.
+void add_sound_jobs(struct JobBatch *batch);
+// At most this many sounds play at once (1..32, default 32). When all voices are busy a new sound
+// replaces the least important one, see kSoundPriorities. Call before init_audio().
+void set_voice_limit(int num_voices);
+u32 init_audio();  // returns SDL_AudioDeviceID
 void play_sound(SoundId);
 void play_looped_sound(SoundId);
 void stop_looped_sounds();
@@ -0,0 +1,37 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdbool.h>
+
+#include "base.h"
+
+// Returns the current time in counter ticks, e.g. SDL_GetPerformanceCounter
+typedef u64 ClockSource(void);
+
+// Sampled once per frame by clock_tick(). Everything that runs during the frame reads now and dt
+// from here instead of asking the OS again, so all of it sees the same time. A virtual clock
+// ignores the real time and advances by a fixed step each frame, which makes replay runs see the
+// same times on every run.
+typedef struct FrameClock {
+  ClockSource *source;  // NULL for a virtual clock
+  u64 frequency;        // counter ticks per second
+  u64 step;             // virtual clock only, counter ticks per frame
+  u64 now;              // at the last clock_tick()
+  double dt;            // seconds between the last two clock_tick() calls
+} FrameClock;
+
+void clock_start(FrameClock *clock, ClockSource *source, u64 frequency);
+void clock_start_virtual(FrameClock *clock, double frame_seconds);
+bool clock_is_virtual(FrameClock *clock);
+
+// Call once at the start of every frame
+void clock_tick(FrameClock *clock);
+// Leaves the time spent since the last clock_tick() out of the next dt
+void clock_skip(FrameClock *clock);
+
+// The time right now, for waiting until a deadline. A virtual clock always returns clock->now.
+u64 clock_read(FrameClock *clock);
+u64 clock_ticks(FrameClock *clock, double seconds);
+double clock_seconds(FrameClock *clock, u64 ticks);
+
+#endif  // CLOCK_H
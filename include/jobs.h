@@ -0,0 +1,30 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <SDL2/SDL.h>
+
+#include "base.h"
+
+typedef void JobFunction(void *data);
+
+typedef struct Job {
+  JobFunction *function;
+  void *data;
+} Job;
+
+// A fixed set of independent jobs run by a few worker threads. All jobs are added before
+// start_jobs(), the workers take them in order until none are left.
+typedef struct JobBatch {
+  Job jobs[64];
+  int num;
+  SDL_atomic_t next;  // index of the next job to take
+  SDL_Thread *threads[8];
+  int num_threads;
+} JobBatch;
+
+void add_job(JobBatch *batch, JobFunction *function, void *data);
+void start_jobs(JobBatch *batch);
+// Runs the jobs that are left on the calling thread too, returns when every job is done
+void finish_jobs(JobBatch *batch);
+
+#endif  // JOBS_H
@@ -1,3 +1,6 @@
+#ifndef LEVELS_H
+#define LEVELS_H
+
 #define LEVEL_WIDTH 40
 #define LEVEL_HEIGHT 23
 
@@ -521,3 +524,5 @@ static char *gLevels[20] = {
 // Level >= 10 check later
 static int gLevel_min_diamonds[20] = {6, 4, 8, 18, 9, 4, 4, 3, 15, 10,
                                       5, 5, 5, 5,  5, 5, 5, 5, 5,  5};
+
+#endif  // LEVELS_H
@@ -0,0 +1,38 @@
+#ifndef MIX_H
+#define MIX_H
+
+#include <stdbool.h>
+
+#include "base.h"
+
+// Volumes go from 0 to MIX_MAX_VOLUME, the same scale as SDL_MIX_MAXVOLUME
+#define MIX_MAX_VOLUME 128
+
+// Adds len_frames frames of src scaled by volume to the stereo frames in dst, saturating every
+// sample to the 16-bit range. A mono src (channels == 1) goes to both channels. All kernels give
+// bit-identical results, except MIX_KERNEL_SDL which rounds negative samples toward zero.
+typedef void MixFunction(short *dst, const short *src, int len_frames, int channels, int volume);
+
+typedef enum MixKernel {
+  MIX_KERNEL_SCALAR,
+  MIX_KERNEL_SSE2,
+  MIX_KERNEL_AVX2,
+  MIX_KERNEL_SDL,  // SDL_MixAudioFormat(), kept to compare against
+
+  MIX_KERNEL_COUNT
+} MixKernel;
+
+extern char *gMixKernelNames[MIX_KERNEL_COUNT];
+
+// The kernel used by mix_samples(), set to the fastest one the CPU supports by init_mixer()
+extern MixKernel gMixKernel;
+
+void init_mixer();
+// Returns false if the CPU can't run the kernel, gMixKernel is left as it was then
+bool set_mix_kernel(MixKernel kernel);
+MixKernel mix_kernel_from_name(char *name);  // MIX_KERNEL_COUNT if there is no such kernel
+
+void mix_samples(short *dst, const short *src, int len_frames, int channels, int volume);
+MixFunction *get_mix_function(MixKernel kernel);
+
+#endif  // MIX_H
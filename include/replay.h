@@ -0,0 +1,63 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "base.h"
+#include "sim.h"
+
+// A replay holds the input of every simulation tick of a single level attempt. Together with the
+// level id it is enough to reproduce the attempt exactly; a checksum of the tiles after each tick
+// lets the player detect any divergence. Every keyframe_interval ticks a copy of the whole Level is
+// kept as well, so seeking only has to simulate from the closest keyframe. Keyframe 0 is the level
+// before the first tick, so playback never has to rebuild it.
+//
+// File layout (little endian):
+//   ReplayHeader
+//   u8    inputs[num_ticks]        packed Input, see pack_input()
+//   u32   checksums[num_ticks]     hash_tiles() of Level.tiles after the tick
+//   Level keyframes[num_keyframes] keyframe i is the level at tick i * keyframe_interval
+typedef struct ReplayHeader {
+  char magic[4];  // "BDRP"
+  u32 version;
+  u32 level_id;
+  u32 seed;  // seed for rand()
+  u32 num_ticks;
+  u32 level_size;  // sizeof(Level), keyframes are only valid for the same build
+  u32 keyframe_interval;
+  u32 num_keyframes;
+} ReplayHeader;
+
+typedef struct Replay {
+  int level_id;
+  u32 seed;
+  int num_ticks;
+  int capacity;  // in ticks
+  u8 *inputs;
+  u32 *checksums;
+
+  int keyframe_interval;  // in ticks
+  int num_keyframes;
+  int keyframe_capacity;
+  Level *keyframes;
+} Replay;
+
+u8 pack_input(Input input);
+Input unpack_input(u8 packed);
+u32 hash_tiles(Tiles tiles);
+
+// Clear the replay to record a new attempt starting from level, after sim_start_level()
+void replay_start(Replay *replay, int level_id, u32 seed, Level *level);
+// Call after every sim_step() with the input that was used for it
+void replay_record(Replay *replay, Input input, Level *level);
+// Input for the tick which takes the level from `tick` to `tick + 1`
+Input replay_input(Replay *replay, int tick);
+// Returns false if the tiles differ from what was recorded after the tick
+bool replay_check(Replay *replay, int tick, Level *level);
+// Put the level into the state it had at `tick`, restoring the closest keyframe and simulating
+// the rest. Returns false if the replay doesn't have that many ticks.
+bool replay_seek(Replay *replay, Level *level, int tick);
+
+bool replay_save(Replay *replay, char *file_name);
+bool replay_load(Replay *replay, char *file_name);
+void replay_free(Replay *replay);
+
+#endif  // REPLAY_H
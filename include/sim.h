@@ -0,0 +1,265 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+
+#include "audio.h"
+#include "base.h"
+#include "levels.h"
+
+// The simulation advances in fixed logical ticks. All gameplay delays are expressed in ticks so
+// that the same inputs always produce the same cave, no matter how fast we render.
+#define SIM_TICKS_PER_SECOND 60
+
+// The caves in levels.h are written with one char per tile, load_level() turns them into TileType
+typedef enum TileType {
+  TILE_EMPTY,             // '_'
+  TILE_DIRT,              // '.'
+  TILE_WALL,              // 'w'
+  TILE_STEEL_WALL,        // 'W'
+  TILE_ROCK,              // 'r'
+  TILE_DIAMOND,           // 'd'
+  TILE_PLAYER,            // 'p'
+  TILE_ENEMY,             // 'f'
+  TILE_BUTTERFLY,         // 'b'
+  TILE_WATER,             // 'a'
+  TILE_MAGIC_WALL,        // 'm'
+  TILE_MAGIC_WALL_ON,     // 'M'
+  TILE_LOCK,              // 'l', left behind by a sliding object for a moment
+  TILE_EXIT_CLOSED,       // 'X'
+  TILE_EXIT,              // 'x'
+  TILE_ENTRANCE,          // 'E'
+  TILE_PLAYER_APPEARING,  // 'S'
+  TILE_PLAYER_EXITED,     // 'N'
+  TILE_EXPLOSION,         // '!'
+  TILE_LOADING,           // 'L', loading screen
+  TILE_HIDDEN,            // '*', loading screen, not drawn at all
+  TILE_UNKNOWN,           // any other char, blocks everything and is drawn as empty
+
+  TILE_TYPE_COUNT
+} TileType;
+
+typedef u8 Tile;  // TileType
+typedef Tile Tiles[LEVEL_HEIGHT][LEVEL_WIDTH];
+
+// A cave row fits in a u64, bit x is set if the tile at x belongs to the class. The masks are kept
+// up to date by set_tile() and let the physics look at whole rows at once.
+typedef u64 RowMask[LEVEL_HEIGHT];
+
+typedef enum TileMask {
+  TILE_MASK_EMPTY,    // '_'
+  TILE_MASK_ROCK,     // 'r'
+  TILE_MASK_DIAMOND,  // 'd'
+  TILE_MASK_WALL,     // 'w', objects slide off it
+  TILE_MASK_LOCK,     // 'l'
+  TILE_MASK_ENEMY,    // 'f', 'b'
+  TILE_MASK_TRAP,     // 'p', 'm', 'M', only matter for falling objects
+  TILE_MASK_OTHER,    // everything the physics doesn't care about
+
+  TILE_MASK_COUNT
+} TileMask;
+
+typedef enum TileFlags {
+  TILE_PLAYER_CAN_ENTER = 1 << 0,
+  TILE_ENEMY_CAN_ENTER = 1 << 1,
+  TILE_ROUNDED = 1 << 2,  // objects on top slide off it
+  TILE_HEAVY = 1 << 3,    // keeps the object below from sliding
+  TILE_GROUND = 1 << 4,   // a falling object stops here
+} TileFlags;
+
+typedef struct TileInfo {
+  char symbol;  // as written in levels.h
+  u8 mask;      // TileMask
+  u8 flags;     // TileFlags
+} TileInfo;
+
+extern TileInfo gTileInfo[TILE_TYPE_COUNT];
+
+static inline bool tile_is(Tile tile, TileFlags flags) {
+  return (gTileInfo[tile].flags & flags) != 0;
+}
+
+typedef struct {
+  bool right;
+  bool left;
+  bool up;
+  bool down;
+
+  bool quit;
+  bool reset;
+  bool pickup;  // collect diamond without moving with Ctrl
+
+  bool any_key;  // check if ane key pressed (to starts)
+} Input;
+
+typedef struct {
+  int x;
+  int y;
+} v2;
+
+typedef struct Stone {
+  v2 pos;
+  bool falling;
+} Stone;
+
+static inline v2 V2(int x, int y) {
+  v2 result = {x, y};
+  return result;
+}
+
+static inline v2 sum_v2(v2 a, v2 b) {
+  return V2(a.x + b.x, a.y + b.y);
+}
+
+typedef struct Rect {
+  int left;
+  int top;
+  int right;
+  int bottom;
+} Rect;
+
+static inline Rect create_rect(int left, int top, int right, int bottom) {
+  Rect result = {left, top, right, bottom};
+  return result;
+}
+
+// Every container below keeps a tile -> slot map next to its array so that finding the object at
+// a position costs a single lookup. A slot is stored as index + 1, 0 means there is no object.
+typedef u16 Slots[LEVEL_HEIGHT][LEVEL_WIDTH];
+
+typedef struct Objects {
+  Stone objects[LEVEL_WIDTH * LEVEL_HEIGHT / 3];
+  int num;
+  Slots slots;
+  RowMask falling;  // positions of objects with falling set
+  // Bit i is set if objects[i] may move on its next drop. An object goes to sleep when a drop
+  // leaves it in place and is woken up by set_tile() when any tile it looks at changes.
+  u64 awake[(LEVEL_WIDTH * LEVEL_HEIGHT / 3 + 63) / 64];
+} Objects;
+
+typedef struct Waters {
+  v2 pos[LEVEL_WIDTH * LEVEL_HEIGHT / 2];
+  int num;
+  Slots slots;
+} Waters;
+
+typedef struct {
+  v2 pos;
+  int lifetime;
+} Lock;
+
+typedef struct Enemy {
+  v2 pos;
+  v2 direction;
+} Enemy;
+
+typedef struct Enemies {
+  Enemy objects[40];
+  int num;
+  Slots slots;
+} Enemies;
+
+typedef struct MagicWall {
+  v2 bricks[20];
+  int start_tick;
+  int num;
+  bool is_on;
+} MagicWall;
+
+#define MAX_EXPLOSIONS 5
+
+typedef struct Explosion {
+  bool active;
+  Tile type;  // what exploded: TILE_ENEMY, TILE_BUTTERFLY or TILE_PLAYER
+  Rect area;
+  int start_tick;
+  int duration;  // in ticks
+} Explosion;
+
+typedef struct Level {
+  Tiles tiles;
+  RowMask tile_masks[TILE_MASK_COUNT];
+  Objects diamonds;
+  Objects rocks;
+  Enemies enemies;
+  Enemies butterflies;
+  Lock locks[10];
+  Explosion explosions[MAX_EXPLOSIONS];
+  Waters waters;
+  v2 player_pos;  // in tiles
+  v2 enemy_pos;
+  MagicWall magic_wall;
+  int time_left;
+  int score_per_diamond;
+  int min_diamonds;
+  int diamonds_collected;
+
+  // Simulation state, everything is measured in ticks
+  int tick;  // number of ticks simulated since the level was loaded
+  int level_time;
+  int player_last_move_tick;
+  int rock_start_move_tick;
+  bool rock_is_pushed;
+  int walking_sound_cooldown;
+  bool flooding_sound_on;
+  SoundId sound_out_of_time;
+  int diamond_sound_num;
+} Level;
+
+typedef enum SimOutcome {
+  SIM_RUNNING,
+  SIM_PLAYER_DIED,
+  SIM_LEVEL_COMPLETE,
+  SIM_OUT_OF_TIME,
+} SimOutcome;
+
+// Everything the outside world has to react to after a tick. The simulation never touches audio
+// or the screen itself.
+typedef struct SimEvents {
+  SoundId sounds[16];  // each at most once
+  int num_sounds;
+  SoundId looped_sounds[4];  // looped sounds to start
+  int num_looped_sounds;
+  bool stop_looped_sounds;  // applied before starting looped_sounds
+  int score;                // score earned during the tick
+  bool white_tunnel;        // enough diamonds collected, flash the empty tiles
+} SimEvents;
+
+// Parts of sim_step() that are timed when sim.c is compiled with SIM_PROFILE
+typedef enum SimSubsystem {
+  SUBSYSTEM_PLAYER,
+  SUBSYSTEM_FLOODING,
+  SUBSYSTEM_ENEMIES,
+  SUBSYSTEM_DROP,
+  SUBSYSTEM_EXPLOSIONS,
+
+  SUBSYSTEM_COUNT
+} SimSubsystem;
+
+#ifdef SIM_PROFILE
+// Provided by the profiling harness
+u64 sim_profile_now();  // in nanoseconds
+void sim_profile_record(SimSubsystem subsystem, u64 ns);
+#endif
+
+// Implementation of the rock and diamond physics, they all give the same result
+typedef enum Physics {
+  PHYSICS_LOOP,        // step every object, see drop_objects()
+  PHYSICS_BITBOARD,    // find the objects to step with row masks, see drop_objects_bitboard()
+  PHYSICS_ACTIVE_SET,  // step only objects that are awake, see drop_objects_awake()
+} Physics;
+
+extern Physics gPhysics;
+
+Tile tile_from_symbol(char symbol);
+void load_level(Level *level, int num_level);
+// The player appears at the entrance. Call once after load_level(), before the first tick, every
+// replay starts from this state.
+void sim_start_level(Level *level);
+// All changes to Level.tiles have to go through here to keep the tile masks valid
+void set_tile(Level *level, int x, int y, Tile tile);
+
+// Advance the level by exactly one tick
+SimOutcome sim_step(Level *level, Input input, SimEvents *events);
+
+#endif  // SIM_H
@@ -0,0 +1,40 @@
+#include "jobs.h"
+
+#include <assert.h>
+
+void add_job(JobBatch *batch, JobFunction *function, void *data) {
+  assert(batch->num < COUNT(batch->jobs));
+  Job *job = &batch->jobs[batch->num++];
+  job->function = function;
+  job->data = data;
+}
+
+int run_jobs(void *data) {
+  JobBatch *batch = data;
+  for (;;) {
+    int i = SDL_AtomicAdd(&batch->next, 1);
+    if (i >= batch->num) return 0;
+    batch->jobs[i].function(batch->jobs[i].data);
+  }
+}
+
+void start_jobs(JobBatch *batch) {
+  // One core is left for the thread that calls finish_jobs()
+  int num_threads = SDL_GetCPUCount() - 1;
+  if (num_threads > COUNT(batch->threads)) num_threads = COUNT(batch->threads);
+  if (num_threads > batch->num) num_threads = batch->num;
+
+  for (int i = 0; i < num_threads; i++) {
+    SDL_Thread *thread = SDL_CreateThread(run_jobs, "jobs", batch);
+    if (thread == NULL) break;  // finish_jobs() runs whatever is left
+    batch->threads[batch->num_threads++] = thread;
+  }
+}
+
+void finish_jobs(JobBatch *batch) {
+  run_jobs(batch);
+  for (int i = 0; i < batch->num_threads; i++) {
+    SDL_WaitThread(batch->threads[i], NULL);  // also makes the results visible to this thread
+  }
+  batch->num_threads = 0;
+}
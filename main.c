@@ -1,3 +1,4 @@
+#include <SDL2/SDL.h>
 #include <SDL2/SDL_rect.h>
 #include <SDL2/SDL_render.h>
 #include <SDL2/SDL_stdinc.h>
@@ -12,8 +13,13 @@
 
 #include "audio.h"
 #include "base.h"
+#include "clock.h"
+#include "jobs.h"
 #include "levels.h"
 #include "lib/stb_image.h"
+#include "mix.h"
+#include "replay.h"
+#include "sim.h"
 
 // ======================================= Types ===================================================
 
@@ -63,137 +69,79 @@ typedef enum AnimationId {
   ANIM_COUNT,
 } AnimationId;
 
-typedef char Tiles[LEVEL_HEIGHT][LEVEL_WIDTH];
-
-typedef struct {
-  bool right;
-  bool left;
-  bool up;
-  bool down;
-
-  bool quit;
-  bool reset;
-  bool pickup;  // collect diamond without moving with Ctrl
-
-  bool any_key;  // check if ane key pressed (to starts)
-} Input;
-
-typedef struct {
-  int x;
-  int y;
-} v2;
-
-typedef struct Stone {
-  v2 pos;
-  bool falling;
-} Stone;
-
-static inline v2 V2(int x, int y) {
-  v2 result = {x, y};
-  return result;
-}
-
-static inline v2 sum_v2(v2 a, v2 b) {
-  return V2(a.x + b.x, a.y + b.y);
-}
-
-typedef struct Rect {
-  int left;
-  int top;
-  int right;
-  int bottom;
-} Rect;
-
-static inline Rect create_rect(int left, int top, int right, int bottom) {
-  Rect result = {left, top, right, bottom};
-  return result;
-}
-
-typedef struct Objects {
-  Stone objects[LEVEL_WIDTH * LEVEL_HEIGHT / 3];
-  int num;
-} Objects;
-
-typedef struct Waters {
-  v2 pos[LEVEL_WIDTH * LEVEL_HEIGHT / 2];
-  int num;
-} Waters;
-
-typedef struct {
-  v2 pos;
-  int lifetime;
-} Lock;
-
-typedef struct Enemy {
-  v2 pos;
-  v2 direction;
-} Enemy;
-
-typedef struct Enemies {
-  Enemy objects[40];
-  int num;
-} Enemies;
-
-typedef struct MagicWall {
-  v2 bricks[20];
-  u64 start_time;
-  int num;
-  bool is_on;
-} MagicWall;
-
 typedef struct {
   v2 start_frame;
-  u64 start_time;
   int num_frames;
   int fps;
   int times_to_play;  // how many times to play animation in total; 0 if indefinitely
 } Animation;
 
+typedef enum SpriteKind {
+  SPRITE_STATIC,
+  SPRITE_ANIMATED,
+  SPRITE_MOVING,  // see get_moving_frame()
+  SPRITE_NONE,    // not drawn at all
+} SpriteKind;
+
+typedef struct TileSprite {
+  SpriteKind kind;
+  v2 src;            // SPRITE_STATIC
+  AnimationId anim;  // SPRITE_ANIMATED
+} TileSprite;
+
+// Textured quads collected during a frame and submitted with one SDL_RenderGeometry() call per
+// run of sprites sharing a texture
+typedef struct SpriteBatch {
+  SDL_Renderer *renderer;
+  SDL_Texture *texture;
+  v2 texture_size;
+  SDL_Vertex vertices[4 * 4096];
+  int indices[6 * 4096];
+  int num_sprites;
+} SpriteBatch;
+
+// The static tiles of the cave drawn once into a texture. Only tiles that changed since the last
+// frame are drawn again, animated tiles are drawn on top every frame.
+typedef struct TileLayer {
+  SDL_Texture *target;   // the whole cave, gTileSize pixels per tile
+  SDL_Texture *texture;  // sprites the layer was drawn with
+  Tiles tiles;           // tiles as they are in target
+  bool valid;            // false if target has to be drawn from scratch
+  bool unsupported;      // target couldn't be created, draw_level() is used instead
+} TileLayer;
+
 typedef struct AnimationMoving {
   v2 start_frame;
   v2 end_frame;
-  u64 start_time;
   double duration;  // in seconds
 } AnimationMoving;
 
-typedef struct Explosion {
-  bool active;
-  char type;
-  Rect area;
-  u64 start_time;
-  double duration;  // in seconds
-} Explosion;
-
 typedef struct {
   SDL_Renderer *renderer;
   SDL_Texture *texture;
   v2 window_offset;
 } DrawContext;
 
-// For different colors for
-typedef struct BackColor {
-  int r;  // red
-  int g;  // green
-  int b;  // blue
-} BackColor;
-
-typedef struct Level {
-  Tiles tiles;
-  Objects diamonds;
-  Objects rocks;
-  Enemies enemies;
-  Enemies butterflies;
-  Lock locks[10];
-  Explosion explosions[5];
-  Waters waters;
-  v2 player_pos;  // in tiles
-  v2 enemy_pos;
-  MagicWall magic_wall;
-  int time_left;
-  int score_per_diamond;
-  int min_diamonds;
-  int diamonds_collected;
-} Level;
+// bd-sprites.png recolored for the current cave, see set_sprite_colors()
+typedef struct SpriteSheet {
+  char *filename;
+  SDL_Texture *texture;
+  int width;
+  int height;
+  u8 *pixels;         // RGB as loaded
+  u8 *color_indices;  // per pixel, i + 1 if it has kSpriteColors[i], 0 if it never changes
+  u8 *recolored;      // RGB uploaded to texture
+  BackColorId color_id;
+} SpriteSheet;
+
+// A PNG decoded by decode_image() on a loader thread, create_texture() uploads it
+typedef struct Image {
+  char *filename;
+  int width;
+  int height;
+  int num_channels;
+  u8 *pixels;  // NULL if the file couldn't be decoded
+} Image;
 
 typedef struct Viewport {
   // in pixels
@@ -209,172 +157,279 @@ typedef struct Viewport {
   Rect player_area;
 } Viewport;
 
+typedef struct StatusBar {
+  int score;
+  int time_left;
+  int min_diamonds;
+  int diamonds_collected;
+  int score_per_diamond;
+} StatusBar;
+
+// Everything render_level_gameplay() needs from the simulation, taken after every tick
+typedef struct RenderSnapshot {
+  Tiles tiles;
+  v2 player_pos;
+  AnimationId player_animation;
+  Explosion explosions[MAX_EXPLOSIONS];
+  StatusBar status;
+  int tick;
+  int white_tunnel_tick;  // last tick the empty tiles flashed at
+  StateId next;           // LEVEL_GAMEPLAY, or the state the tick ended the level with
+} RenderSnapshot;
+
+// Lock-free triple buffer. The simulation fills slots[back] while the main thread draws
+// slots[front], the third slot holds the newest complete snapshot. Publishing and taking a
+// snapshot swap a slot with the third one in a single SDL_AtomicSet(), so neither side ever
+// waits for the other and the main thread always gets the latest tick.
+typedef struct SnapshotBuffer {
+  RenderSnapshot slots[3];
+  int back;             // simulation only
+  int front;            // main thread only
+  SDL_atomic_t latest;  // index of the third slot, with kSnapshotFresh until it is taken
+} SnapshotBuffer;
+
+typedef struct SimThread {
+  SDL_Thread *thread;  // NULL when the main thread runs the ticks
+  SDL_atomic_t stop;
+  SDL_SpinLock input_lock;
+  Input input;  // latest input from the main thread
+  SnapshotBuffer snapshots;
+} SimThread;
+
 typedef struct GameState {
   Level level;
   DrawContext draw_context;
+  DrawContext logo_draw_context;
   Viewport viewport;
   StateId state_id;
+  double state_time;  // seconds since the state was entered
+  Input input;        // reset when a state is entered
   int level_id;
   int score;
+
+  // Used by a single state each
+  Tiles load_tiles;                     // LEVEL_STARTING, cover over the cave
+  u32 seed;                             // LEVEL_STARTING, for rand(), recorded in the replay
+  bool player_appeared;                 // LEVEL_STARTING
+  SimThread sim;                        // LEVEL_GAMEPLAY
+  double tick_backlog;                  // LEVEL_GAMEPLAY, seconds of wall time not simulated yet
+  int white_tunnel_tick;                // LEVEL_GAMEPLAY
+  int drawn_tick;                       // LEVEL_GAMEPLAY, tick of the snapshot drawn last
+  AnimationId player_animation;         // LEVEL_GAMEPLAY
+  AnimationId previous_direction_anim;  // LEVEL_GAMEPLAY
+  double score_plus_time;               // LEVEL_ENDING, seconds since the last time to score step
+
+  Replay replay;      // input of the current level attempt
+  char *replay_file;  // where to save recorded attempts, NULL if not recording
+  bool playback;      // drive the level from replay instead of the keyboard
+  int seek_tick;      // tick to jump to when playback starts
 } GameState;
+
+// How the main loop waits between two frames of a state
+typedef enum Pacing {
+  PACING_DISPLAY,   // once per display refresh, for smooth scrolling
+  PACING_SIM_RATE,  // at most SIM_TICKS_PER_SECOND frames a second
+  PACING_EVENTS,    // doesn't animate, sleeps until an event and redraws only when gScreenDirty
+} Pacing;
+
+typedef struct Screen {
+  void (*enter)(GameState *state);
+  // Returns the state to switch to, or the current one to stay
+  StateId (*update)(GameState *state, double dt);
+  void (*render)(GameState *state);
+  // Optional, runs before switching away and may pick another next state
+  StateId (*leave)(GameState *state, StateId next);
+  Pacing pacing;
+} Screen;
 // ======================================= Globals =================================================
 
 Animation gAnimations[ANIM_COUNT] = {
-    {{0, 320}, 0, 8, 15, 0},   // ANIM_DIAMOND,
-    {{0, 288}, 0, 8, 15, 0},   // ANIM_ENEMY,
-    {{32, 0}, 0, 4, 15, 1},    // ANIM_ENEMY_EXPLODED,
-    {{0, 352}, 0, 8, 15, 0},   // ANIM_BUTTERFLY,
-    {{64, 224}, 0, 7, 15, 1},  // ANIM_BUTTERFLY_EXPLODED,
-    {{0, 33}, 0, 8, 15, 0},    // ANIM_IDLE1,
-    {{0, 128}, 0, 8, 25, 0},   // ANIM_GO_LEFT,
-    {{0, 160}, 0, 8, 25, 0},   // ANIM_GO_RIGHT,
-    {{0, 66}, 0, 8, 10, 0},    // ANIM_IDLE2,
-    {{0, 98}, 0, 8, 10, 0},    // ANIM_IDLE3,
-    {{32, 192}, 0, 2, 4, 0},   // ANIM_EXIT,
-    {{32, 0}, 0, 3, 3, 0},     // ANIM_PLAYER_HERE,
-    {{0, 256}, 0, 8, 25, 0},   // ANIM_WATER,
-    {{96, 192}, 0, 5, 20, 0},  // ANIM_MAGIC_WALL,
+    {{0, 320}, 8, 15, 0},   // ANIM_DIAMOND,
+    {{0, 288}, 8, 15, 0},   // ANIM_ENEMY,
+    {{32, 0}, 4, 15, 1},    // ANIM_ENEMY_EXPLODED,
+    {{0, 352}, 8, 15, 0},   // ANIM_BUTTERFLY,
+    {{64, 224}, 7, 15, 1},  // ANIM_BUTTERFLY_EXPLODED,
+    {{0, 33}, 8, 15, 0},    // ANIM_IDLE1,
+    {{0, 128}, 8, 25, 0},   // ANIM_GO_LEFT,
+    {{0, 160}, 8, 25, 0},   // ANIM_GO_RIGHT,
+    {{0, 66}, 8, 10, 0},    // ANIM_IDLE2,
+    {{0, 98}, 8, 10, 0},    // ANIM_IDLE3,
+    {{32, 192}, 2, 4, 0},   // ANIM_EXIT,
+    {{32, 0}, 3, 3, 0},     // ANIM_PLAYER_HERE,
+    {{0, 256}, 8, 25, 0},   // ANIM_WATER,
+    {{96, 192}, 5, 20, 0},  // ANIM_MAGIC_WALL,
+};
+
+TileSprite gTileSprites[TILE_TYPE_COUNT] = {
+    {SPRITE_STATIC, {0, 192}},                // TILE_EMPTY
+    {SPRITE_STATIC, {32, 224}},               // TILE_DIRT
+    {SPRITE_STATIC, {96, 192}},               // TILE_WALL
+    {SPRITE_STATIC, {32, 192}},               // TILE_STEEL_WALL
+    {SPRITE_STATIC, {0, 224}},                // TILE_ROCK
+    {SPRITE_ANIMATED, {}, ANIM_DIAMOND},      // TILE_DIAMOND
+    {SPRITE_STATIC, {0, 192}},                // TILE_PLAYER, drawn on top of the level
+    {SPRITE_ANIMATED, {}, ANIM_ENEMY},        // TILE_ENEMY
+    {SPRITE_ANIMATED, {}, ANIM_BUTTERFLY},    // TILE_BUTTERFLY
+    {SPRITE_ANIMATED, {}, ANIM_WATER},        // TILE_WATER
+    {SPRITE_STATIC, {96, 192}},               // TILE_MAGIC_WALL
+    {SPRITE_ANIMATED, {}, ANIM_MAGIC_WALL},   // TILE_MAGIC_WALL_ON
+    {SPRITE_STATIC, {0, 192}},                // TILE_LOCK
+    {SPRITE_STATIC, {32, 192}},               // TILE_EXIT_CLOSED
+    {SPRITE_ANIMATED, {}, ANIM_EXIT},         // TILE_EXIT
+    {SPRITE_ANIMATED, {}, ANIM_EXIT},         // TILE_ENTRANCE
+    {SPRITE_ANIMATED, {}, ANIM_PLAYER_HERE},  // TILE_PLAYER_APPEARING
+    {SPRITE_ANIMATED, {}, ANIM_GO_RIGHT},     // TILE_PLAYER_EXITED
+    {SPRITE_STATIC, {0, 192}},                // TILE_EXPLOSION
+    {SPRITE_MOVING},                          // TILE_LOADING
+    {SPRITE_NONE},                            // TILE_HIDDEN
+    {SPRITE_STATIC, {0, 192}},                // TILE_UNKNOWN
+};
+
+v2 gAnimationFrames[ANIM_COUNT];  // current frame of every animation
+v2 gMovingFrame;                  // current frame of the loading screen tiles
+
+// Colors of bd-sprites.png that change from cave to cave, the rest of the sheet stays the same
+u32 kSpriteColors[5] = {0x8f6a36, 0xfff700, 0xd9d326, 0xa26d2e, 0x26d926};
+
+u32 gSpritePalettes[BACK_COLOR_COUNT][COUNT(kSpriteColors)] = {
+    {0x36378f, 0x0004ff, 0x2628d9, 0x2e30a2, 0x2628d9},  // BG_BLUE
+    {0x408f36, 0x1bff00, 0x39d926, 0x3aa22e, 0x39d926},  // BG_GREEN
+    {0x8f3636, 0xff0000, 0xd92626, 0xa22e2e, 0xd92626},  // BG_RED
+    {0x36798f, 0x00c1ff, 0x26add9, 0x2e86a2, 0x26add9},  // BG_SKY
+    {0x8f6a36, 0xfff700, 0xd9d326, 0xa26d2e, 0x26d926},  // BG_NORMAL
+    {0x8d368f, 0xf800ff, 0xd426d9, 0x9f2ea2, 0xd426d9},  // BG_VIOLET
 };
 
-SDL_Texture *gBackColorTextures[BACK_COLOR_COUNT];
+SpriteSheet gSpriteSheet;
+TileLayer gTileLayer;
+SpriteBatch gSpriteBatch;
 BackColorId gLevel_colors[20] = {BG_NORMAL, BG_VIOLET, BG_BLUE,   BG_GREEN,  BG_RED,
                                  BG_SKY,    BG_NORMAL, BG_VIOLET, BG_NORMAL, BG_VIOLET,
                                  BG_BLUE,   BG_GREEN,  BG_RED,    BG_SKY,    BG_NORMAL,
                                  BG_VIOLET, BG_NORMAL, BG_VIOLET, BG_BLUE,   BG_GREEN};
 
 int gTileSize;
+FrameClock gClock;    // ticked once per frame by run_main_loop()
+bool gScreenDirty;    // what is on screen got lost, screens that don't animate have to redraw it
+double gFramePeriod;  // seconds between two PACING_DISPLAY frames, from the display mode
 
 // ======================================= Functions ===============================================
 
-u64 time_now() {
-  return SDL_GetPerformanceCounter();
-}
+void handle_event(Input *input, SDL_Event event) {
+  if (event.type == SDL_QUIT) {
+    input->quit = true;
+  }
 
-double seconds_since(u64 timestamp) {
-  return (double)(time_now() - timestamp) / gPerformanceFrequency;
-}
+  if (event.type == SDL_RENDER_TARGETS_RESET || event.type == SDL_RENDER_DEVICE_RESET) {
+    gTileLayer.valid = false;        // contents of the render target are lost
+    gTileLayer.unsupported = false;  // try to create it again
+    gScreenDirty = true;
+  }
+  if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+    gScreenDirty = true;
+  }
 
-void process_input(Input *input) {
-  SDL_Event event;
-  while (SDL_PollEvent(&event)) {
-    if (event.type == SDL_QUIT) {
-      input->quit = true;
+  if (event.type == SDL_KEYDOWN) {
+    if (event.key.keysym.scancode == SDL_SCANCODE_RIGHT) {
+      input->right = true;
     }
-
-    if (event.type == SDL_KEYDOWN) {
-      if (event.key.keysym.scancode == SDL_SCANCODE_RIGHT) {
-        input->right = true;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_LEFT) {
-        input->left = true;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_UP) {
-        input->up = true;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_DOWN) {
-        input->down = true;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_LCTRL) {
-        input->pickup = true;
-      }
+    if (event.key.keysym.scancode == SDL_SCANCODE_LEFT) {
+      input->left = true;
+    }
+    if (event.key.keysym.scancode == SDL_SCANCODE_UP) {
+      input->up = true;
+    }
+    if (event.key.keysym.scancode == SDL_SCANCODE_DOWN) {
+      input->down = true;
+    }
+    if (event.key.keysym.scancode == SDL_SCANCODE_LCTRL) {
+      input->pickup = true;
     }
+  }
 
-    if (event.type == SDL_KEYUP) {
-      input->any_key = true;
-      if (event.key.keysym.scancode == SDL_SCANCODE_ESCAPE) {
-        input->quit = true;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_RIGHT) {
-        input->right = false;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_LEFT) {
-        input->left = false;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_UP) {
-        input->up = false;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_DOWN) {
-        input->down = false;
-      }
-      if (event.key.keysym.sym == 'r') {
-        input->reset = true;
-      }
-      if (event.key.keysym.scancode == SDL_SCANCODE_LCTRL) {
-        input->pickup = false;
-      }
+  if (event.type == SDL_KEYUP) {
+    input->any_key = true;
+    if (event.key.keysym.scancode == SDL_SCANCODE_ESCAPE) {
+      input->quit = true;
+    }
+    if (event.key.keysym.scancode == SDL_SCANCODE_RIGHT) {
+      input->right = false;
+    }
+    if (event.key.keysym.scancode == SDL_SCANCODE_LEFT) {
+      input->left = false;
+    }
+    if (event.key.keysym.scancode == SDL_SCANCODE_UP) {
+      input->up = false;
+    }
+    if (event.key.keysym.scancode == SDL_SCANCODE_DOWN) {
+      input->down = false;
+    }
+    if (event.key.keysym.sym == 'r') {
+      input->reset = true;
+    }
+    if (event.key.keysym.scancode == SDL_SCANCODE_LCTRL) {
+      input->pickup = false;
     }
   }
 }
 
-void add_water(Level *level, int x, int y) {
-  level->waters.pos[level->waters.num].x = x;
-  level->waters.pos[level->waters.num].y = y;
-  level->waters.num++;
-  level->tiles[y][x] = 'a';
+void process_input(Input *input) {
+  SDL_Event event;
+  while (SDL_PollEvent(&event)) {
+    handle_event(input, event);
+  }
 }
 
-void load_level(Level *level, int num_level) {
-  SDL_memset(level, 0, sizeof(*level));
-  SDL_memcpy(level->tiles, gLevels[num_level], LEVEL_HEIGHT * LEVEL_WIDTH);
-
-  level->magic_wall.num = 0;
-  level->magic_wall.is_on = false;
-
-  for (int y = 0; y < LEVEL_HEIGHT; ++y) {
-    for (int x = 0; x < LEVEL_WIDTH; ++x) {
-      if (level->tiles[y][x] == 'E') {
-        level->player_pos.x = x;
-        level->player_pos.y = y;
-      }
-
-      if (level->tiles[y][x] == 'f') {
-        level->enemies.objects[level->enemies.num].pos.x = x;
-        level->enemies.objects[level->enemies.num].pos.y = y;
-        level->enemies.objects[level->enemies.num].direction = V2(1, 0);  // to the right
-        level->enemies.num++;
-        assert(level->enemies.num < COUNT(level->enemies.objects));
-      }
+// ===== Frame pacing =====
+// Used by run_main_loop() according to the Pacing of the current state. Presenting doesn't wait
+// for vsync, so every state paces itself and sleeps in SDL_WaitEventTimeout between frames,
+// handling events as they arrive. PACING_DISPLAY states redraw once per display refresh. Nothing
+// else on screen changes faster than the simulation ticks, so PACING_SIM_RATE states redraw at
+// most SIM_TICKS_PER_SECOND times a second. States that don't animate at all are only redrawn
+// when gScreenDirty is set.
+
+const double kIdleWakeup = 0.1;  // seconds, PACING_EVENTS states still see time pass
+
+// Blocks until an event arrives or the deadline passes, then handles all pending events. Returns
+// false on timeout. With a virtual clock there is nothing to wait for, pending events are handled
+// and it returns false right away.
+bool wait_for_events(Input *input, u64 deadline) {
+  u64 now = clock_read(&gClock);
+  if (clock_is_virtual(&gClock) || now >= deadline) {
+    process_input(input);
+    return false;
+  }
 
-      if (level->tiles[y][x] == 'b') {
-        level->butterflies.objects[level->butterflies.num].pos.x = x;
-        level->butterflies.objects[level->butterflies.num].pos.y = y;
-        level->butterflies.objects[level->butterflies.num].direction = V2(1, 0);  // to the right
-        level->butterflies.num++;
-        assert(level->butterflies.num < COUNT(level->butterflies.objects));
-      }
+  SDL_Event event;
+  int timeout_ms = (int)ceil(clock_seconds(&gClock, deadline - now) * 1000);
+  if (!SDL_WaitEventTimeout(&event, timeout_ms)) return false;
 
-      if (level->tiles[y][x] == 'r') {
-        level->rocks.objects[level->rocks.num].pos.x = x;
-        level->rocks.objects[level->rocks.num].pos.y = y;
-        level->rocks.objects[level->rocks.num].falling = false;
-        level->rocks.num++;
-        assert(level->rocks.num < COUNT(level->rocks.objects));
-      }
+  handle_event(input, event);
+  process_input(input);
+  return true;
+}
 
-      if (level->tiles[y][x] == 'd') {
-        level->diamonds.objects[level->diamonds.num].pos.x = x;
-        level->diamonds.objects[level->diamonds.num].pos.y = y;
-        level->diamonds.objects[level->diamonds.num].falling = false;
-        level->diamonds.num++;
-        assert(level->diamonds.num < COUNT(level->diamonds.objects));
-      }
+// Hands the input to the simulation thread, if there is one, as soon as it changes rather than
+// once per frame
+void publish_input(GameState *state) {
+  SimThread *sim = &state->sim;
+  if (sim->thread == NULL) return;
 
-      if (level->tiles[y][x] == 'a') {
-        add_water(level, x, y);
-      }
+  SDL_AtomicLock(&sim->input_lock);
+  sim->input = state->input;
+  SDL_AtomicUnlock(&sim->input_lock);
+}
 
-      if (level->tiles[y][x] == 'm') {
-        level->magic_wall.bricks[level->magic_wall.num].x = x;
-        level->magic_wall.bricks[level->magic_wall.num].y = y;
-        level->magic_wall.num++;
-      }
-    }
+// Call once per redraw, returns when the next one is due or the player wants to quit
+void wait_for_next_frame(u64 *next_frame, double period, GameState *state) {
+  *next_frame += clock_ticks(&gClock, period);
+  u64 now = clock_read(&gClock);
+  if (*next_frame < now) {
+    *next_frame = now;  // fell behind, don't try to catch up
+  }
+  while (!state->input.quit && wait_for_events(&state->input, *next_frame)) {
+    publish_input(state);
   }
-
-  level->time_left = 150;
-  level->score_per_diamond = 10;
-  level->min_diamonds = gLevel_min_diamonds[num_level];
-  level->diamonds_collected = 0;
 }
 
 v2 lerp(v2 vec1, v2 vec2, double t) {
@@ -383,9 +438,9 @@ v2 lerp(v2 vec1, v2 vec2, double t) {
   return V2(x, y);
 }
 
-v2 get_frame_from(u64 start_time, AnimationId anim_id) {
+v2 get_frame_at(double seconds, AnimationId anim_id) {
   Animation *animation = &gAnimations[anim_id];
-  int frames_played_since_start = (int)(seconds_since(start_time) * animation->fps);
+  int frames_played_since_start = (int)(seconds * animation->fps);
   int frame_index = frames_played_since_start % animation->num_frames;
   if (animation->times_to_play > 0 &&
       frames_played_since_start / animation->num_frames > animation->times_to_play) {
@@ -394,392 +449,86 @@ v2 get_frame_from(u64 start_time, AnimationId anim_id) {
   return V2(animation->start_frame.x + frame_index * 32, animation->start_frame.y);
 }
 
-v2 get_frame(AnimationId anim_id) {
-  Animation *animation = &gAnimations[anim_id];
-  return get_frame_from(animation->start_time, anim_id);
-}
-
-v2 get_moving_frame() {
-  AnimationMoving anim = {{97, 476}, {129, 444}, 0, 0.8};
-  double cycles_passed = seconds_since(anim.start_time) / anim.duration;
+v2 get_moving_frame_at(double seconds) {
+  AnimationMoving anim = {{97, 476}, {129, 444}, 0.8};
+  double cycles_passed = seconds / anim.duration;
   double whole_cycles;
   double part_cycle = modf(cycles_passed, &whole_cycles);
   return lerp(anim.start_frame, anim.end_frame, part_cycle);
 }
 
-v2 turn_right(v2 direction) {
-  return V2(-direction.y, direction.x);
-}
-
-v2 turn_left(v2 direction) {
-  return V2(direction.y, -direction.x);
-}
-
-bool out_of_bounds(v2 pos) {
-  return (pos.x < 0 || pos.x >= LEVEL_WIDTH || pos.y < 0 || pos.y >= LEVEL_HEIGHT);
-}
-
-bool can_move(Level *level, v2 pos) {
-  if (out_of_bounds(pos)) {
-    return false;
-  }
-  char tile_type = level->tiles[pos.y][pos.x];
-  if (tile_type == ' ' || tile_type == '.' || tile_type == '_' || tile_type == 'd' ||
-      (tile_type == 'x')) {
-    return true;
-  }
-  return false;
-}
-
-bool enemy_can_move(Level *level, v2 pos) {
-  if (out_of_bounds(pos)) {
-    return false;
-  }
-  char tile_type = level->tiles[pos.y][pos.x];
-  if (tile_type == '_' || tile_type == ' ' || tile_type == 'p' || tile_type == 'a') {
-    return true;
-  }
-  return false;
-}
-
-void remove_enemy(Enemies *enemies, v2 pos) {
-  for (int i = 0; i < enemies->num; i++) {
-    if (enemies->objects[i].pos.x == pos.x && enemies->objects[i].pos.y == pos.y) {
-      v2 *pos = &enemies->objects[i].pos;
-      v2 *pos_lst = &enemies->objects[enemies->num - 1].pos;
-      *pos = *pos_lst;
-      enemies->num -= 1;
-      return;
-    }
-  }
-}
-
-void remove_water(Waters *waters, v2 pos) {
-  for (int i = 0; i < waters->num; i++) {
-    if (waters->pos[i].x == pos.x && waters->pos[i].y == pos.y) {
-      v2 *pos = &waters->pos[i];
-      v2 *pos_lst = &waters->pos[waters->num - 1];
-      *pos = *pos_lst;
-      waters->num -= 1;
-      return;
-    }
-  }
-}
-
-void remove_obj(Objects *objs, v2 pos) {
-  for (int i = 0; i < objs->num; i++) {
-    if (objs->objects[i].pos.x == pos.x && objs->objects[i].pos.y == pos.y) {
-      v2 *pos = &objs->objects[i].pos;
-      v2 *pos_lst = &objs->objects[objs->num - 1].pos;
-      bool *falling = &objs->objects[i].falling;
-      bool *falling_lst = &objs->objects[objs->num - 1].falling;
-      *pos = *pos_lst;
-      *falling = *falling_lst;
-      objs->num -= 1;
-    }
+// Resolve the frame of every animation once per frame. Animations follow the simulation tick
+// rather than the wall clock, so a replay always shows the same frames.
+void update_animations(int tick) {
+  double seconds = (double)tick / SIM_TICKS_PER_SECOND;
+  for (int i = 0; i < ANIM_COUNT; i++) {
+    gAnimationFrames[i] = get_frame_at(seconds, i);
   }
+  gMovingFrame = get_moving_frame_at(seconds);
 }
 
-void add_obj(Objects *objs, v2 pos) {
-  objs->objects[objs->num].pos = pos;
-  objs->objects[objs->num++].falling = false;
-  assert(objs->num < COUNT(objs->objects));
-}
-
-void stop_magic_wall(Level *level) {
-  for (int i = 0; i < level->magic_wall.num; i++) {  // 20 number of bricks for magic wall for level
-    level->tiles[level->magic_wall.bricks[i].y][level->magic_wall.bricks[i].x] = 'm';
-  }
-  level->magic_wall.start_time = 0;
-  level->magic_wall.is_on = false;
-  stop_looped_sounds();
-}
-
-void add_explosion(Level *level, v2 pos, char type) {
-  assert(type == 'f' || type == 'b' || type == 'p');
-
-  v2 start = sum_v2(pos, V2(-1, -1));
-  v2 end = sum_v2(pos, V2(1, 1));
-
-  // Don't blow up the outer walls
-  if (start.x == 0) {
-    start.x++;
-    end.x++;
-  }
-  if (end.x == LEVEL_WIDTH - 1) {
-    start.x--;
-    end.x--;
-  }
-  if (start.y == 1) {
-    start.y++;
-    end.y++;
-  }
-  if (end.y == LEVEL_HEIGHT - 1) {
-    start.y--;
-    end.y--;
-  }
-
-  Rect area = create_rect(start.x, start.y, end.x, end.y);
-
-  // Remove objects and set tiles
-  for (int y = area.top; y <= area.bottom; ++y) {
-    for (int x = area.left; x <= area.right; ++x) {
-      char tile = level->tiles[y][x];
-      if (tile == 'r') {
-        remove_obj(&level->rocks, V2(x, y));
-      } else if (tile == 'd') {
-        remove_obj(&level->diamonds, V2(x, y));
-      } else if (tile == 'f') {
-        remove_enemy(&level->enemies, V2(x, y));
-      } else if (tile == 'b') {
-        remove_enemy(&level->butterflies, V2(x, y));
-      } else if (tile == 'a') {
-        remove_water(&level->waters, V2(x, y));
-      }
-      level->tiles[y][x] = '!';  // ignore this tile when draw
-    }
-  }
-
-  // Activate explosion
-  bool added = false;
-  for (int i = 0; i < COUNT(level->explosions); ++i) {
-    Explosion *explosion = &level->explosions[i];
-    if (explosion->active) continue;
-
-    explosion->active = true;
-    explosion->type = type;
-    explosion->area = area;
-    explosion->start_time = time_now();
-
-    if (type == 'f' || type == 'p') {
-      explosion->duration = 4.0 / 15.0;  // NOTE: based on the animation
-    } else if (type == 'b') {
-      explosion->duration = 7.0 / 15.0;  // NOTE: based on the animation
-    }
-    added = true;
-    break;
-  }
-  assert(added);
+// Current frame, see update_animations()
+v2 get_frame(AnimationId anim_id) {
+  return gAnimationFrames[anim_id];
 }
 
-// Return True if enemy kills player
-bool move_enemies(Level *level, char obj_sym) {
-  Enemies *enemies;
-
-  if (obj_sym == 'f') {
-    enemies = &level->enemies;
-  } else if (obj_sym == 'b') {
-    enemies = &level->butterflies;
-  } else {
-    assert(!"Unknown obj sym");
-  }
-
-  for (int i = 0; i < enemies->num; ++i) {
-    Enemy *enemy = &enemies->objects[i];
-
-    assert(level->tiles[enemy->pos.y][enemy->pos.x] == obj_sym);
-    level->tiles[enemy->pos.y][enemy->pos.x] = '_';  // "erase"
-
-    v2 pos_forward = sum_v2(enemy->pos, enemy->direction);
-    v2 pos_right = sum_v2(enemy->pos, turn_right(enemy->direction));
-    v2 pos_right_diag = sum_v2(pos_right, V2(-enemy->direction.x, -enemy->direction.y));
-    v2 prev_enemy_pos = enemy->pos;
-
-    if (enemy_can_move(level, pos_right) &&
-        level->tiles[pos_right_diag.y][pos_right_diag.x] != '_') {
-      // Turn and move right
-      enemy->pos = pos_right;
-      enemy->direction = turn_right(enemy->direction);
-    } else if (enemy_can_move(level, pos_forward)) {
-      // Move forward
-      enemy->pos = pos_forward;
-    } else {
-      // Turn left in place
-      enemy->direction = turn_left(enemy->direction);
-      enemy->pos = enemy->pos;
-    }
-
-    if (level->tiles[enemy->pos.y][enemy->pos.x] == 'p') {
-      play_sound(SOUND_EXPLODED);
-      add_explosion(level, V2(enemy->pos.x, enemy->pos.y), 'p');
-      return true;
-    }
-
-    if (level->tiles[enemy->pos.y][enemy->pos.x] == 'a') {  // water collision
-      play_sound(SOUND_EXPLODED);
-      enemy->pos = prev_enemy_pos;  // do not move enemy to next position to explode it
-      level->tiles[enemy->pos.y][enemy->pos.x] = obj_sym;
-      add_explosion(level, V2(enemy->pos.x, enemy->pos.y), obj_sym);
-    } else {
-      level->tiles[enemy->pos.y][enemy->pos.x] = obj_sym;  // "draw"
-    }
-  }
-
-  return false;
+v2 get_moving_frame() {
+  return gMovingFrame;
 }
 
-bool can_move_rock(Level *level, v2 pos, v2 next_pos) {
-  if (((pos.x < next_pos.x) && (level->tiles[pos.y][next_pos.x + 1] == '_')) ||
-      ((pos.x > next_pos.x) && (level->tiles[pos.y][next_pos.x - 1] == '_'))) {
-    return true;
-  }
-  return false;
-}
+// Submit all sprites collected so far. Has to be called before presenting and before switching
+// render targets.
+void flush_sprites() {
+  SpriteBatch *batch = &gSpriteBatch;
+  if (batch->num_sprites == 0) return;
 
-void add_lock(Lock *locks, int x, int y) {
-  for (int i = 0; i < sizeof(&locks); i++) {
-    if (locks[i].lifetime == 0) {
-      locks[i].lifetime = 2;
-      locks[i].pos.x = x;
-      locks[i].pos.y = y;
-      return;
-    }
-  }
-  assert(!"Not enough space for locks");
+  SDL_RenderGeometry(batch->renderer, batch->texture, batch->vertices, batch->num_sprites * 4,
+                     batch->indices, batch->num_sprites * 6);
+  batch->num_sprites = 0;
 }
 
-// Returns true if player is killed
-bool drop_objects(Level *level, char obj_sym) {
-  bool play_fall_sound = false;
-  Objects *objs;
-
-  if (obj_sym == 'd') {
-    objs = &level->diamonds;
-  } else if (obj_sym == 'r') {
-    objs = &level->rocks;
-  } else {
-    assert(!"Unknown obj sym");
-  }
-
-  for (int i = 0; i < objs->num; i++) {
-    Stone *stone = &objs->objects[i];
-    int x = stone->pos.x;
-    int y = stone->pos.y;
-    bool falling = stone->falling;
-
-    assert(level->tiles[y][x] == obj_sym);
-
-    char tile_above = level->tiles[y - 1][x];
-    char tile_under = level->tiles[y + 1][x];
-
-    // A falling rock or diamond activate magic wall
-    if (tile_under == 'm' && falling && !level->magic_wall.is_on) {
-      for (int j = 0; j < level->magic_wall.num; j++) {
-        v2 brick = level->magic_wall.bricks[j];
-        level->tiles[brick.y][brick.x] = 'M';
-      }
-      level->magic_wall.start_time = time_now();
-      level->magic_wall.is_on = true;
-      play_looped_sound(SOUND_MAGIC_WALL);
-      play_sound(SOUND_DIAMOND_1);
-      tile_under = level->tiles[y + 1][x];
-    }
-
-    // Kill enemy
-    if (tile_under == 'f' || tile_under == 'b') {
-      play_sound(SOUND_EXPLODED);
-      play_fall_sound = true;
-      add_explosion(level, V2(x, y + 1), tile_under);
-    }
-
-    // Kill player
-    if (falling && tile_under == 'p') {
-      play_sound(SOUND_EXPLODED);
-      play_fall_sound = true;
-      add_explosion(level, V2(x, y + 1), tile_under);
-      return true;
-    }
-
-    // If there is space in the position below the magic wall then the rock/diamond morphs into a
-    // falling diamond/rock and moves down two positions, to be below the magic wall
-    if (tile_under == 'M' && (level->tiles[y + 2][x] == '_' || level->tiles[y + 2][x] == 'l') &&
-        falling) {
-      stone->pos.y += 2;
-      level->tiles[y][x] = '_';
-
-      if (obj_sym == 'r') {  // if rock is falling
-        play_sound(SOUND_DIAMOND_1);
-        remove_obj(&level->rocks, V2(x, y + 2));  // remove rock
-        add_obj(&level->diamonds, V2(x, y + 2));
-        level->tiles[y + 2][x] = 'd';
-      } else if (obj_sym == 'd') {  // if diamond is falling
-        play_sound(SOUND_STONE);
-        remove_obj(&level->diamonds, V2(x, y + 2));  // remove diamond
-        add_obj(&level->rocks, V2(x, y + 2));
-        level->tiles[y + 2][x] = 'r';
-      }
-      continue;
-    }
-
-    if (tile_under == '_') {
-      stone->falling = true;
-
-      // Drop down
-      level->tiles[y][x] = '_';
-      level->tiles[y + 1][x] = obj_sym;
-      stone->pos.y += 1;
-
-      // Determine whether we play sound.
-      // Check every tile below and play sound only if falling on
-      // a steady ground or on a stack of boulders that are already
-      // on the ground
-      play_fall_sound = true;  // in case we never enter the loop
-      for (int i = y + 2; i < LEVEL_HEIGHT; ++i) {
-        char tile = level->tiles[i][x];
-        if (tile == '_') {
-          play_fall_sound = false;  // the rock is still falling
-          break;
-        }
-        if (tile == '.' || tile == 'W' || tile == 'w') {
-          play_fall_sound = true;
-          break;  // falling on solid ground.
-        }
-      }
-      continue;  // don't check if we can slide
-    } else {
-      stone->falling = false;
-    }
-
-    // Slide off rocks and diamonds
-    if ((tile_under == 'r' || tile_under == 'd' || tile_under == 'w') &&
-        (tile_above != 'd' && tile_above != 'r' && tile_above != 'l')) {
-      if (level->tiles[y][x - 1] == '_' && level->tiles[y + 1][x - 1] == '_') {
-        // Drop left
-        level->tiles[y][x] = 'l';
-        add_lock(level->locks, x, y);
-        level->tiles[y][x - 1] = obj_sym;
-        stone->pos.x -= 1;
-        continue;
-      }
-      if (level->tiles[y][x + 1] == '_' && level->tiles[y + 1][x + 1] == '_') {
-        // Drop right
-        level->tiles[y][x] = 'l';
-        add_lock(level->locks, x, y);
-        level->tiles[y][x + 1] = obj_sym;
-        stone->pos.x += 1;
-        continue;
-      }
-    }
-  }
-
-  if (play_fall_sound) {
-    if (obj_sym == 'r') {
-      play_sound(SOUND_STONE);
-    } else if (obj_sym == 'd') {
-      static int diamond_sound_num = 0;
-      play_sound(SOUND_DIAMOND_1 + diamond_sound_num);
-      diamond_sound_num = (diamond_sound_num + 1) % 7;
-    }
+void draw_sprite(SDL_Renderer *renderer, SDL_Texture *texture, SDL_Rect src, SDL_Rect dst) {
+  SpriteBatch *batch = &gSpriteBatch;
+  if (texture != batch->texture || renderer != batch->renderer ||
+      batch->num_sprites == COUNT(batch->indices) / 6) {
+    flush_sprites();  // keep the drawing order
+    batch->renderer = renderer;
+    batch->texture = texture;
+    SDL_QueryTexture(texture, NULL, NULL, &batch->texture_size.x, &batch->texture_size.y);
   }
 
-  return false;
+  float u0 = (float)src.x / batch->texture_size.x;
+  float v0 = (float)src.y / batch->texture_size.y;
+  float u1 = (float)(src.x + src.w) / batch->texture_size.x;
+  float v1 = (float)(src.y + src.h) / batch->texture_size.y;
+  float x0 = dst.x;
+  float y0 = dst.y;
+  float x1 = dst.x + dst.w;
+  float y1 = dst.y + dst.h;
+
+  SDL_Color white = {255, 255, 255, 255};
+  SDL_Vertex *vertex = &batch->vertices[batch->num_sprites * 4];
+  vertex[0] = (SDL_Vertex){{x0, y0}, white, {u0, v0}};
+  vertex[1] = (SDL_Vertex){{x1, y0}, white, {u1, v0}};
+  vertex[2] = (SDL_Vertex){{x1, y1}, white, {u1, v1}};
+  vertex[3] = (SDL_Vertex){{x0, y1}, white, {u0, v1}};
+
+  int first = batch->num_sprites * 4;
+  int *index = &batch->indices[batch->num_sprites * 6];
+  index[0] = first;
+  index[1] = first + 1;
+  index[2] = first + 2;
+  index[3] = first + 2;
+  index[4] = first + 3;
+  index[5] = first;
+  batch->num_sprites++;
 }
 
 void draw_tile_px(DrawContext *context, v2 src, v2 dst) {
   SDL_Rect src_rect = {src.x, src.y, 32, 32};
   SDL_Rect dst_rect = {context->window_offset.x + dst.x, context->window_offset.y + dst.y,
                        gTileSize, gTileSize};
-  SDL_RenderCopy(context->renderer, context->texture, &src_rect, &dst_rect);
+  draw_sprite(context->renderer, context->texture, src_rect, dst_rect);
 }
 
 void draw_tile(DrawContext *context, v2 src, v2 dst) {
@@ -840,7 +589,7 @@ void draw_char(DrawContext *context, v2 pos, char letter, bool small_char, Color
   SDL_Rect src_rect = {src.x, src.y, 32, 16};
   SDL_Rect dst_rect = {context->window_offset.x + dst.x, context->window_offset.y + dst.y,
                        letter_size, letter_size};
-  SDL_RenderCopy(context->renderer, context->texture, &src_rect, &dst_rect);
+  draw_sprite(context->renderer, context->texture, src_rect, dst_rect);
 }
 
 void draw_logo(DrawContext *context, v2 pos) {
@@ -848,13 +597,19 @@ void draw_logo(DrawContext *context, v2 pos) {
   v2 dst = {pos.x, pos.y};  // in px
   SDL_Rect dst_rect = {context->window_offset.x + dst.x, context->window_offset.y + dst.y, 609 * 2,
                        273 * 2};
-  SDL_RenderCopy(context->renderer, context->texture, &src_rect, &dst_rect);
+  draw_sprite(context->renderer, context->texture, src_rect, dst_rect);
 }
 
-void draw_status_bar(GameState *state) {
+StatusBar get_status_bar(GameState *state) {
+  Level *level = &state->level;
+  StatusBar status = {state->score, level->time_left, level->min_diamonds,
+                      level->diamonds_collected, level->score_per_diamond};
+  return status;
+}
+
+void draw_status_bar(GameState *state, StatusBar status) {
   Viewport *viewport = &state->viewport;
   DrawContext *draw_context = &state->draw_context;
-  Level *level = &state->level;
 
   // Draw status bar's background black
   for (int x = 0; x < (viewport->width - 1); x++) {
@@ -873,13 +628,13 @@ void draw_status_bar(GameState *state) {
 
   // Display overall score
   v2 pos_score = {viewport->width - 7, 0};
-  draw_number(draw_context, state->score, pos_score, COLOR_WHITE, 6);
+  draw_number(draw_context, status.score, pos_score, COLOR_WHITE, 6);
 
   if (state->state_id == LEVEL_STARTING) return;
 
   // Display time
   v2 pos_time = {viewport->width / 2, 0};
-  draw_number(draw_context, level->time_left, pos_time, COLOR_WHITE, 3);
+  draw_number(draw_context, status.time_left, pos_time, COLOR_WHITE, 3);
 
   if (state->state_id == LEVEL_ENDING) return;
 
@@ -887,29 +642,30 @@ void draw_status_bar(GameState *state) {
   v2 white_diamond = {256, 32};
   draw_tile(draw_context, white_diamond, V2(2, 0));
 
-  if (level->diamonds_collected < level->min_diamonds) {
-    draw_number(draw_context, level->min_diamonds, V2(0, 0), COLOR_YELLOW, 2);
+  if (status.diamonds_collected < status.min_diamonds) {
+    draw_number(draw_context, status.min_diamonds, V2(0, 0), COLOR_YELLOW, 2);
   } else {
     draw_tile(draw_context, white_diamond, V2(0, 0));
     draw_tile(draw_context, white_diamond, V2(1, 0));
   }
-  draw_number(draw_context, level->score_per_diamond, V2(3, 0), COLOR_WHITE, 2);
+  draw_number(draw_context, status.score_per_diamond, V2(3, 0), COLOR_WHITE, 2);
 
   // Display number of collected diamonds
   v2 pos_diamonds = {10, 0};
-  draw_number(draw_context, level->diamonds_collected, pos_diamonds, COLOR_YELLOW, 2);
+  draw_number(draw_context, status.diamonds_collected, pos_diamonds, COLOR_YELLOW, 2);
 }
 
 void update_screen(DrawContext *draw_context, int level_id) {
+  flush_sprites();
   SDL_RenderPresent(draw_context->renderer);
   SDL_RenderClear(draw_context->renderer);
 }
 
-void move_viewport(Level *level, Viewport *viewport, int step) {
+void move_viewport(v2 player_pos, Viewport *viewport, int step) {
   v2 viewport_pos = {viewport->x / gTileSize, viewport->y / gTileSize};
   v2 target_pos = viewport_pos;
 
-  int rel_player_x = level->player_pos.x - viewport_pos.x;
+  int rel_player_x = player_pos.x - viewport_pos.x;
   if (rel_player_x >= viewport->player_area.right) {
     target_pos.x += rel_player_x - viewport->player_area.right;
     if (target_pos.x > viewport->max.x) {
@@ -923,7 +679,7 @@ void move_viewport(Level *level, Viewport *viewport, int step) {
     }
   }
 
-  int rel_player_y = level->player_pos.y - viewport_pos.y;
+  int rel_player_y = player_pos.y - viewport_pos.y;
   if (rel_player_y >= viewport->player_area.bottom) {
     target_pos.y += rel_player_y - viewport->player_area.bottom;
     if (target_pos.y > viewport->max.y) {
@@ -951,23 +707,21 @@ void move_viewport(Level *level, Viewport *viewport, int step) {
   }
 }
 
-void draw_explosions(Explosion *explosions, DrawContext *draw_context, Viewport *viewport) {
-  for (int i = 0; i < COUNT(&explosions); ++i) {
+// tick is the simulation tick the explosions are drawn at
+void draw_explosions(Explosion *explosions, int tick, DrawContext *draw_context,
+                     Viewport *viewport) {
+  for (int i = 0; i < MAX_EXPLOSIONS; ++i) {
     Explosion *e = &explosions[i];
-
-    if (seconds_since(e->start_time) > e->duration) {
-      e->active = false;
-    }
-    if (!e->active) continue;
+    if (!e->active || tick - e->start_tick > e->duration) continue;
 
     AnimationId anim;
-    if (e->type == 'f' || e->type == 'p') {
+    if (e->type == TILE_ENEMY || e->type == TILE_PLAYER) {
       anim = ANIM_ENEMY_EXPLODED;
-    } else if (e->type == 'b') {
+    } else if (e->type == TILE_BUTTERFLY) {
       anim = ANIM_BUTTERFLY_EXPLODED;
     }
 
-    v2 src = get_frame_from(e->start_time, anim);
+    v2 src = get_frame_at((double)(tick - e->start_tick) / SIM_TICKS_PER_SECOND, anim);
     for (int y = e->area.top; y <= e->area.bottom; ++y) {
       for (int x = e->area.left; x <= e->area.right; ++x) {
         draw_tile_px(draw_context, src,
@@ -980,44 +734,17 @@ void draw_explosions(Explosion *explosions, DrawContext *draw_context, Viewport
 void draw_level(Tiles tiles, DrawContext *draw_context, Viewport *viewport) {
   for (int y = 0; y < viewport->height; y++) {
     for (int x = 0; x < viewport->width; x++) {
-      v2 src = {0, 192};
       v2 dst = {x * gTileSize - viewport->x % gTileSize, y * gTileSize - viewport->y % gTileSize};
-      char tile_type = tiles[viewport->y / gTileSize + y][viewport->x / gTileSize + x];
-      if (tile_type == '*') {
+      Tile tile = tiles[viewport->y / gTileSize + y][viewport->x / gTileSize + x];
+      TileSprite *sprite = &gTileSprites[tile];
+
+      v2 src = sprite->src;
+      if (sprite->kind == SPRITE_NONE) {
         continue;  // ignore tile completely
-      }
-      if (tile_type == 'r') {
-        src = V2(0, 224);
-      } else if (tile_type == 'w' || tile_type == 'm') {
-        src = V2(96, 192);
-      } else if (tile_type == 'W') {
-        src = V2(32, 192);
-      } else if (tile_type == 'L') {
+      } else if (sprite->kind == SPRITE_ANIMATED) {
+        src = get_frame(sprite->anim);
+      } else if (sprite->kind == SPRITE_MOVING) {
         src = get_moving_frame();
-      } else if (tile_type == '.') {
-        src = V2(32, 224);
-      } else if (tile_type == 'E') {
-        src = get_frame(ANIM_EXIT);
-      } else if (tile_type == 'N') {
-        src = get_frame(ANIM_GO_RIGHT);
-      } else if (tile_type == 'd') {
-        src = get_frame(ANIM_DIAMOND);
-      } else if (tile_type == 'f') {
-        src = get_frame(ANIM_ENEMY);
-      } else if (tile_type == 'b') {
-        src = get_frame(ANIM_BUTTERFLY);
-      } else if (tile_type == 'X') {
-        src = V2(32, 192);
-      } else if (tile_type == 'x') {
-        src = get_frame(ANIM_EXIT);
-      } else if (tile_type == 'S') {
-        src = get_frame(ANIM_PLAYER_HERE);
-      } else if (tile_type == 'a') {
-        src = get_frame(ANIM_WATER);
-      } else if (tile_type == 'M') {
-        src = get_frame(ANIM_MAGIC_WALL);
-      } else if (tile_type == '!') {
-        src = V2(0, 192);
       }
 
       draw_tile_px(draw_context, src, dst);
@@ -1026,516 +753,723 @@ void draw_level(Tiles tiles, DrawContext *draw_context, Viewport *viewport) {
   draw_outside_border(draw_context, viewport);
 }
 
-StateId start_game(GameState *state, DrawContext *logo_draw_context) {
-  DrawContext *draw_context = &state->draw_context;
-  Viewport *viewport = &state->viewport;
+// Bring the layer up to date with tiles, returns false if render targets aren't supported
+bool update_tile_layer(TileLayer *layer, Tiles tiles, DrawContext *draw_context) {
+  SDL_Renderer *renderer = draw_context->renderer;
+  if (layer->unsupported) return false;
+  if (!layer->target) {
+    // Only tried once, the whole cave can be larger than the maximum texture size at high DPI
+    layer->unsupported = true;
+    if (!SDL_RenderTargetSupported(renderer)) return false;
+    layer->target = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_TARGET,
+                                      LEVEL_WIDTH * gTileSize, LEVEL_HEIGHT * gTileSize);
+    if (!layer->target) {
+      printf("Couldn't create tile layer, drawing tiles one by one: %s\n", SDL_GetError());
+      return false;
+    }
+    layer->unsupported = false;
+    layer->valid = false;
+  }
+  if (layer->texture != draw_context->texture) {
+    layer->texture = draw_context->texture;  // the colors change with the level
+    layer->valid = false;
+  }
+  if (layer->valid && memcmp(layer->tiles, tiles, sizeof(Tiles)) == 0) {
+    return true;  // most frames, keeps the render target and the sprite batch as they are
+  }
+
+  flush_sprites();
+  SDL_SetRenderTarget(renderer, layer->target);
+  DrawContext layer_context = {renderer, draw_context->texture, V2(0, 0)};
+  for (int y = 0; y < LEVEL_HEIGHT; y++) {
+    for (int x = 0; x < LEVEL_WIDTH; x++) {
+      Tile tile = tiles[y][x];
+      if (layer->valid && layer->tiles[y][x] == tile) continue;
+
+      // Animated tiles go on top of an empty tile
+      TileSprite *sprite = &gTileSprites[tile];
+      v2 src = sprite->kind == SPRITE_STATIC ? sprite->src : gTileSprites[TILE_EMPTY].src;
+      draw_tile(&layer_context, src, V2(x, y));
+      layer->tiles[y][x] = tile;
+    }
+  }
+  flush_sprites();
+  SDL_SetRenderTarget(renderer, NULL);
+  layer->valid = true;
+  return true;
+}
+
+// Same as draw_level(), but the static tiles come from gTileLayer in a single copy
+void draw_cached_level(Tiles tiles, DrawContext *draw_context, Viewport *viewport) {
+  if (!update_tile_layer(&gTileLayer, tiles, draw_context)) {
+    draw_level(tiles, draw_context, viewport);
+    return;
+  }
+
+  SDL_Rect src_rect = {viewport->x, viewport->y, viewport->width * gTileSize,
+                       viewport->height * gTileSize};
+  if (src_rect.x + src_rect.w > LEVEL_WIDTH * gTileSize) {
+    src_rect.w = LEVEL_WIDTH * gTileSize - src_rect.x;
+  }
+  if (src_rect.y + src_rect.h > LEVEL_HEIGHT * gTileSize) {
+    src_rect.h = LEVEL_HEIGHT * gTileSize - src_rect.y;
+  }
+  SDL_Rect dst_rect = {draw_context->window_offset.x, draw_context->window_offset.y, src_rect.w,
+                       src_rect.h};
+  draw_sprite(draw_context->renderer, gTileLayer.target, src_rect, dst_rect);
+
+  v2 first = {viewport->x / gTileSize, viewport->y / gTileSize};
+  for (int y = 0; y < viewport->height && first.y + y < LEVEL_HEIGHT; y++) {
+    for (int x = 0; x < viewport->width && first.x + x < LEVEL_WIDTH; x++) {
+      TileSprite *sprite = &gTileSprites[tiles[first.y + y][first.x + x]];
+      if (sprite->kind == SPRITE_STATIC || sprite->kind == SPRITE_NONE) continue;
+
+      v2 src = sprite->kind == SPRITE_ANIMATED ? get_frame(sprite->anim) : get_moving_frame();
+      v2 dst = {x * gTileSize - viewport->x % gTileSize, y * gTileSize - viewport->y % gTileSize};
+      draw_tile_px(draw_context, src, dst);
+    }
+  }
+  draw_outside_border(draw_context, viewport);
+}
+
+// Job, runs without touching SDL
+void decode_sprite_sheet(void *data) {
+  SpriteSheet *sheet = data;
+  int num_channels;
+  sheet->pixels = stbi_load(sheet->filename, &sheet->width, &sheet->height, &num_channels, 3);
+  if (sheet->pixels == NULL) return;
+
+  int num_pixels = sheet->width * sheet->height;
+  sheet->color_indices = malloc(num_pixels);
+  sheet->recolored = malloc(num_pixels * 3);
+  for (int i = 0; i < num_pixels; i++) {
+    u8 *pixel = &sheet->pixels[i * 3];
+    u32 color = pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+    sheet->color_indices[i] = 0;
+    for (int j = 0; j < COUNT(kSpriteColors); j++) {
+      if (color == kSpriteColors[j]) {
+        sheet->color_indices[i] = j + 1;
+        break;
+      }
+    }
+  }
+  memcpy(sheet->recolored, sheet->pixels, num_pixels * 3);
+}
 
+bool upload_sprite_sheet(SpriteSheet *sheet, SDL_Renderer *renderer) {
+  if (sheet->pixels == NULL) {
+    printf("Couldn't load %s\n", sheet->filename);
+    return false;
+  }
+
+  sheet->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STATIC,
+                                     sheet->width, sheet->height);
+  if (sheet->texture == NULL) {
+    printf("Couldn't create texture: %s\n", SDL_GetError());
+    return false;
+  }
+  sheet->color_id = BG_NORMAL;
+  SDL_UpdateTexture(sheet->texture, NULL, sheet->recolored, sheet->width * 3);
+  return true;
+}
+
+// Swap the cave colors of the sheet. Only pixels with one of kSpriteColors are touched.
+void set_sprite_colors(SpriteSheet *sheet, BackColorId color_id) {
+  if (sheet->color_id == color_id) return;
+
+  u32 *palette = gSpritePalettes[color_id];
+  int num_pixels = sheet->width * sheet->height;
+  for (int i = 0; i < num_pixels; i++) {
+    int index = sheet->color_indices[i];
+    if (index == 0) continue;
+
+    u32 color = palette[index - 1];
+    u8 *pixel = &sheet->recolored[i * 3];
+    pixel[0] = (u8)(color >> 16);
+    pixel[1] = (u8)(color >> 8);
+    pixel[2] = (u8)color;
+  }
+
+  flush_sprites();  // sprites already batched were meant to have the old colors
+  SDL_UpdateTexture(sheet->texture, NULL, sheet->recolored, sheet->width * 3);
+  sheet->color_id = color_id;
+  gTileLayer.valid = false;
+}
+
+// ===== States =====
+// Every state is entered once, then updated and rendered by the main loop until update() returns
+// another state. State time and the sim ticks to run are derived from the dt the loop passes in.
+
+void enter_start_game(GameState *state) {
   play_looped_sound(SOUND_BD1);
+}
 
+StateId update_start_game(GameState *state, double dt) {
+  return state->input.any_key ? LEVEL_STARTING : START_GAME;
+}
+
+void render_start_game(GameState *state) {
+  DrawContext *draw_context = &state->draw_context;
   char msg[22] = "PRESS ANY KEY TO START";
   for (int i = 0; i < 22; i++) {
     v2 pos_char = {gTileSize * (4.5 + i), 12 * gTileSize};
     draw_char(draw_context, pos_char, msg[i], true, COLOR_WHITE);
   }
   v2 pos_logo = {gTileSize * 5.5, 2.5 * gTileSize};
-  draw_logo(logo_draw_context, pos_logo);
-  update_screen(draw_context, state->level_id);
-
-  Input input = {};
-  while (!input.quit) {
-    process_input(&input);
-    if (input.any_key) {
-      return LEVEL_STARTING;
-    }
-  }
-  return START_GAME;
+  draw_logo(&state->logo_draw_context, pos_logo);
 }
 
-StateId level_starting(GameState *state) {
-  Viewport *viewport = &state->viewport;
-  Level *level = &state->level;
-  DrawContext *draw_context = &state->draw_context;
-  Tiles load_tiles;
-  SDL_memcpy(load_tiles, gLoadTiles, LEVEL_HEIGHT * LEVEL_WIDTH);
-
-  // Choose texture
-  BackColorId color_id = gLevel_colors[state->level_id];
-  SDL_Texture *texture = gBackColorTextures[color_id];
-  draw_context->texture = texture;
+void enter_level_starting(GameState *state) {
+  for (int y = 0; y < LEVEL_HEIGHT; y++) {
+    for (int x = 0; x < LEVEL_WIDTH; x++) {
+      state->load_tiles[y][x] = tile_from_symbol(gLoadTiles[y][x]);
+    }
+  }
 
-  Input input = {};
+  // Choose colors
+  set_sprite_colors(&gSpriteSheet, gLevel_colors[state->level_id]);
 
   stop_looped_sounds();
   play_sound(SOUND_COVER);
-  load_level(level, state->level_id);
-
-  srand(time(NULL));
-  u64 start = time_now();
-  bool player_appeared = false;
+  load_level(&state->level, state->level_id);
 
-  while (seconds_since(start) <= 3.5) {
-    draw_level(level->tiles, draw_context, viewport);
+  state->seed = state->playback ? state->replay.seed : (u32)time(NULL);
+  srand(state->seed);
+  state->player_appeared = false;
+}
 
-    process_input(&input);
-    if (input.quit) {
-      return QUIT_GAME;
-    }
+StateId update_level_starting(GameState *state, double dt) {
+  Level *level = &state->level;
 
-    draw_level(load_tiles, draw_context, viewport);
-    // Remove 'wall-tile' from tiles of loading picture if random number (0, 99) > 96
-    for (int y = 0; y < LEVEL_HEIGHT; y++) {
-      for (int x = 0; x < LEVEL_WIDTH; x++) {
-        char *tile = &load_tiles[y][x];
-        if (*tile != 'L') continue;
-        if ((rand() % 100) > 96) {
-          *tile = '*';
-        }
+  // Remove 'wall-tile' from tiles of loading picture if random number (0, 99) > 96
+  for (int y = 0; y < LEVEL_HEIGHT; y++) {
+    for (int x = 0; x < LEVEL_WIDTH; x++) {
+      Tile *tile = &state->load_tiles[y][x];
+      if (*tile != TILE_LOADING) continue;
+      if ((rand() % 100) > 96) {
+        *tile = TILE_HIDDEN;
       }
     }
+  }
 
-    move_viewport(level, viewport, 4);
+  move_viewport(level->player_pos, &state->viewport, 4);
 
-    if (seconds_since(start) > 3.0 && !player_appeared) {
-      v2 pos = level->player_pos;
-      level->tiles[pos.y][pos.x] = 'S';  // add 'bomb' animation before player is appeared
-      play_sound(SOUND_CRACK);
-      player_appeared = true;
-    }
+  if (state->state_time > 3.0 && !state->player_appeared) {
+    sim_start_level(level);  // 'bomb' animation before the player
+    play_sound(SOUND_CRACK);
+    state->player_appeared = true;
+  }
+  return state->state_time > 3.5 ? LEVEL_GAMEPLAY : LEVEL_STARTING;
+}
+
+void render_level_starting(GameState *state) {
+  update_animations((int)(state->state_time * SIM_TICKS_PER_SECOND));
+  draw_cached_level(state->level.tiles, &state->draw_context, &state->viewport);
+  draw_level(state->load_tiles, &state->draw_context, &state->viewport);
+  draw_status_bar(state, get_status_bar(state));
+}
 
-    draw_status_bar(state);
-    update_screen(draw_context, state->level_id);
+void play_sim_sounds(SimEvents *events) {
+  if (events->stop_looped_sounds) {
+    stop_looped_sounds();
+  }
+  for (int i = 0; i < events->num_looped_sounds; i++) {
+    play_looped_sound(events->looped_sounds[i]);
+  }
+  for (int i = 0; i < events->num_sounds; i++) {
+    play_sound(events->sounds[i]);
   }
-  return LEVEL_GAMEPLAY;
 }
 
-StateId level_ending(GameState *state) {
-  const double kScorePlusDelay = 0.02;
-  Level *level = &state->level;
-  DrawContext *draw_context = &state->draw_context;
-  Input input = {};
-  u64 start = time_now();
-  u64 score_plus_last_time = start;
+// ===== Simulation thread =====
+// During LEVEL_GAMEPLAY the cave is simulated on its own thread, so a slow SDL_RenderPresent()
+// doesn't hold back the ticks. Until stop_sim_thread() the thread owns the level, the score, the
+// replay and everything else step_gameplay() touches. The main thread hands it the input and
+// draws the snapshots it publishes. SDL only renders and handles events on the main thread, so that
+// stays the render thread. It doesn't block in SDL_RenderPresent() though: between two frames it
+// waits for events and publishes the input as soon as one arrives, see wait_for_next_frame().
+
+const double kTickSeconds = 1.0 / SIM_TICKS_PER_SECOND;
+const double kMaxTickBacklog = 1.0;  // seconds, anything older is dropped (debugger, suspend)
+const int kSnapshotFresh = 4;        // set in SnapshotBuffer.latest by publish_snapshot()
+
+void init_snapshots(SnapshotBuffer *buffer) {
+  buffer->back = 0;
+  buffer->front = 1;
+  SDL_AtomicSet(&buffer->latest, 2);
+}
 
-  play_sound(SOUND_FINISHED);
-  stop_looped_sounds();
+// Make slots[back] the latest snapshot and carry on in the previous one
+void publish_snapshot(SnapshotBuffer *buffer) {
+  SDL_MemoryBarrierRelease();  // the snapshot is complete before anyone can take it
+  buffer->back = SDL_AtomicSet(&buffer->latest, buffer->back | kSnapshotFresh) & ~kSnapshotFresh;
+  SDL_MemoryBarrierAcquire();  // the main thread is done with the slot we got back
+}
 
-  while ((seconds_since(start) < 3.0) || (level->time_left > 0)) {
-    draw_level(level->tiles, draw_context, &state->viewport);
-    draw_status_bar(state);
+// Stays valid until the next call
+RenderSnapshot *latest_snapshot(SnapshotBuffer *buffer) {
+  if (SDL_AtomicGet(&buffer->latest) & kSnapshotFresh) {
+    SDL_MemoryBarrierRelease();  // done drawing the old front before handing it back
+    buffer->front = SDL_AtomicSet(&buffer->latest, buffer->front) & ~kSnapshotFresh;
+    SDL_MemoryBarrierAcquire();  // see everything written to the new front
+  }
+  return &buffer->slots[buffer->front];
+}
 
-    if (seconds_since(score_plus_last_time) > kScorePlusDelay) {
-      score_plus_last_time = time_now();
-      level->time_left--;
-      state->score += 5;
-    }
+void take_snapshot(GameState *state, StateId next) {
+  SnapshotBuffer *buffer = &state->sim.snapshots;
+  RenderSnapshot *snapshot = &buffer->slots[buffer->back];
+  Level *level = &state->level;
+  memcpy(snapshot->tiles, level->tiles, sizeof(Tiles));
+  snapshot->player_pos = level->player_pos;
+  snapshot->player_animation = state->player_animation;
+  memcpy(snapshot->explosions, level->explosions, sizeof(level->explosions));
+  snapshot->status = get_status_bar(state);
+  snapshot->tick = level->tick;
+  snapshot->white_tunnel_tick = state->white_tunnel_tick;
+  snapshot->next = next;
+  publish_snapshot(buffer);
+}
 
-    process_input(&input);
-    if (input.quit) {
-      return QUIT_GAME;
+void update_player_animation(GameState *state, Input input) {
+  Level *level = &state->level;
+  int ticks_since_move = level->tick - level->player_last_move_tick;
+  if (ticks_since_move > 5 * SIM_TICKS_PER_SECOND) {
+    if (ticks_since_move > 10 * SIM_TICKS_PER_SECOND) {
+      state->player_animation = ANIM_IDLE3;
+    } else {
+      state->player_animation = ANIM_IDLE2;
     }
+  } else if (input.right) {
+    state->player_animation = ANIM_GO_RIGHT;
+    state->previous_direction_anim = ANIM_GO_RIGHT;
+  } else if (input.left) {
+    state->player_animation = ANIM_GO_LEFT;
+    state->previous_direction_anim = ANIM_GO_LEFT;
+  } else if (input.up || input.down) {
+    state->player_animation = state->previous_direction_anim;
+  } else {
+    state->player_animation = ANIM_IDLE1;
+  }
+}
 
-    update_screen(draw_context, state->level_id);
+// Runs one tick on whichever thread simulates and publishes a snapshot of it. Returns the state
+// the level ends with, or LEVEL_GAMEPLAY to keep going.
+StateId step_gameplay(GameState *state, Input input) {
+  Level *level = &state->level;
+  if (state->playback && level->tick >= state->replay.num_ticks) {
+    take_snapshot(state, QUIT_GAME);  // replay is over
+    return QUIT_GAME;
+  }
+  if (state->playback) {
+    input = replay_input(&state->replay, level->tick);
   }
 
-  if (state->level_id >= (COUNT(gLevels) - 1)) {
-    return YOU_WIN;
+  int tick = level->tick;
+  SimEvents events = {};
+  SimOutcome outcome = sim_step(level, input, &events);
+  if (state->playback) {
+    if (!replay_check(&state->replay, tick, level)) {
+      printf("Replay diverged at tick %d\n", tick);
+    }
+  } else {
+    replay_record(&state->replay, input, level);
   }
-  state->level_id++;
-  return LEVEL_STARTING;
+  play_sim_sounds(&events);
+  state->score += events.score;
+  if (events.white_tunnel) {
+    state->white_tunnel_tick = level->tick;
+  }
+  update_player_animation(state, input);
+
+  StateId next = LEVEL_GAMEPLAY;
+  if (outcome == SIM_LEVEL_COMPLETE) {
+    next = LEVEL_ENDING;
+  } else if (outcome == SIM_PLAYER_DIED) {
+    next = PLAYER_DYING;
+  } else if (outcome == SIM_OUT_OF_TIME) {
+    next = OUT_OF_TIME;
+  }
+  take_snapshot(state, next);
+  return next;
 }
 
-StateId player_dying(GameState *state) {
-  Level *level = &state->level;
-  DrawContext *draw_context = &state->draw_context;
-  Input input = {};
-  u64 start = time_now();
-  stop_looped_sounds();
+// Ticks on its own schedule from the real time, independent of the frames
+int run_sim_thread(void *data) {
+  GameState *state = data;
+  SimThread *sim = &state->sim;
+
+  // Only the time source of gClock is used here, now and dt belong to the main thread
+  u64 tick_length = clock_ticks(&gClock, kTickSeconds);
+  u64 next_tick = clock_read(&gClock) + tick_length;
+  while (!SDL_AtomicGet(&sim->stop)) {
+    u64 now = clock_read(&gClock);
+    if (now < next_tick) {
+      SDL_Delay((u32)ceil(clock_seconds(&gClock, next_tick - now) * 1000));
+      continue;
+    }
 
-  while (seconds_since(start) < 2.5) {
-    draw_level(level->tiles, draw_context, &state->viewport);
-    draw_explosions(level->explosions, draw_context, &state->viewport);
-    draw_status_bar(state);
+    // After a hitch the missed ticks run back to back
+    double behind = clock_seconds(&gClock, now - next_tick);
+    if (behind > kMaxTickBacklog) {
+      printf("Simulation fell %.1f s behind, skipping\n", behind - kMaxTickBacklog);
+      next_tick = now;
+    }
+    next_tick += tick_length;
 
-    process_input(&input);
-    if (input.quit) {
-      return QUIT_GAME;
+    SDL_AtomicLock(&sim->input_lock);
+    Input input = sim->input;
+    SDL_AtomicUnlock(&sim->input_lock);
+    if (step_gameplay(state, input) != LEVEL_GAMEPLAY) {
+      break;  // the main thread switches states when it sees the snapshot
     }
+  }
+  return 0;
+}
 
-    update_screen(draw_context, state->level_id);
+// With a virtual clock the ticks stay on the main thread, so that a replay ticks at the same
+// frames on every run
+void start_sim_thread(GameState *state) {
+  SimThread *sim = &state->sim;
+  sim->input = (Input){};
+  SDL_AtomicSet(&sim->stop, 0);
+  sim->thread = NULL;
+  if (clock_is_virtual(&gClock)) return;
+
+  sim->thread = SDL_CreateThread(run_sim_thread, "sim", state);
+  if (sim->thread == NULL) {
+    printf("Couldn't create simulation thread, ticking on the main thread: %s\n", SDL_GetError());
   }
-  return LEVEL_STARTING;
 }
 
-StateId out_of_time(GameState *state) {
-  return player_dying(state);
+void stop_sim_thread(SimThread *sim) {
+  if (sim->thread == NULL) return;
+
+  SDL_AtomicSet(&sim->stop, 1);
+  SDL_WaitThread(sim->thread, NULL);  // also hands the level back to this thread
+  sim->thread = NULL;
 }
 
-void you_win(GameState *state) {
-  DrawContext *draw_context = &state->draw_context;
-  Viewport *viewport = &state->viewport;
+void enter_level_gameplay(GameState *state) {
+  if (!state->playback) {
+    replay_start(&state->replay, state->level_id, state->seed, &state->level);
+  } else if (state->seek_tick > 0) {
+    replay_seek(&state->replay, &state->level, state->seek_tick);
+  }
+  state->tick_backlog = 0;
+  state->white_tunnel_tick = -1;
+  state->drawn_tick = state->level.tick;
+  state->player_animation = ANIM_IDLE1;
+  state->previous_direction_anim = ANIM_GO_RIGHT;
+
+  init_snapshots(&state->sim.snapshots);
+  take_snapshot(state, LEVEL_GAMEPLAY);
+  start_sim_thread(state);
+}
 
-  stop_looped_sounds();
-  play_sound(SOUND_BD1);
-  srand(time(NULL));
-  u64 start = time_now();
-
-  while (seconds_since(start) <= 5.5) {
-    // Display 'YOU WIN'
-    char msg[7] = "YOU WIN";
-    for (int i = 0; i < 7; i++) {
-      v2 pos_char = {gTileSize * (11 + i), 8 * gTileSize};
-      draw_char(draw_context, pos_char, msg[i], false, COLOR_YELLOW);
+StateId update_level_gameplay(GameState *state, double dt) {
+  SimThread *sim = &state->sim;
+  Input *input = &state->input;
+  if (input->reset) {
+    return LEVEL_STARTING;
+  }
+
+  if (sim->thread) {
+    publish_input(state);  // for events handled when the frame was already due
+  } else {
+    // Fixed timestep on this thread: wall time goes into the backlog and is spent in whole ticks.
+    // After a hitch the missed ticks are all simulated, spread over the next frames by
+    // kMaxTicksPerFrame.
+    const int kMaxTicksPerFrame = 8;
+    state->tick_backlog += dt;
+    if (state->tick_backlog > kMaxTickBacklog) {
+      printf("Simulation fell %.1f s behind, skipping\n", state->tick_backlog - kMaxTickBacklog);
+      state->tick_backlog = kMaxTickBacklog;
+    }
+    for (int i = 0; i < kMaxTicksPerFrame && state->tick_backlog >= kTickSeconds; i++) {
+      state->tick_backlog -= kTickSeconds;
+      if (step_gameplay(state, *input) != LEVEL_GAMEPLAY) break;
     }
-    update_screen(draw_context, state->level_id);
   }
+
+  RenderSnapshot *snapshot = latest_snapshot(&sim->snapshots);
+  move_viewport(snapshot->player_pos, &state->viewport, gTileSize);
+  return snapshot->next;
 }
 
-StateId level_gameplay(GameState *state) {
-  Level *level = &state->level;
+void render_level_gameplay(GameState *state) {
+  RenderSnapshot *snapshot = latest_snapshot(&state->sim.snapshots);
   Viewport *viewport = &state->viewport;
   DrawContext *draw_context = &state->draw_context;
 
-  bool rock_is_pushed = false;
-  bool play_sound_water = false;
-  u64 start = time_now();
-  int level_time = level->time_left;
-  u64 rock_start_move_time = start;
-  u64 player_last_move_time = start;
-  int walking_sound_cooldown = 1;
-  u64 drop_last_time = start;
-  u64 enemy_last_move_time = start;
-  u64 flooding_last_time = start;
-  const double kPlayerDelay = 0.1;
-  const double kDropDelay = 0.15;
-  const double kEnemyMoveDelay = 0.15;
-  const double kFloodingDelay = 1.25;
-
-  SoundId sound_out_of_time = SOUND_TIMEOUT_9;
-
-  AnimationId player_animation = ANIM_IDLE1;
-  AnimationId previos_direction_anim = ANIM_GO_RIGHT;
-
-  Input input = {};
-  while (true) {
-    bool white_tunnel = false;
-    double frame_time = seconds_since(start);  // for animation
-
-    process_input(&input);
-    if (input.quit) {
-      return QUIT_GAME;
-    }
-    if (input.reset) {
-      return LEVEL_STARTING;
+  // Draw level
+  update_animations(snapshot->tick);
+  draw_cached_level(snapshot->tiles, draw_context, viewport);
+
+  // Draw player
+  draw_tile(draw_context, get_frame(snapshot->player_animation),
+            V2(snapshot->player_pos.x - viewport->x / gTileSize,
+               snapshot->player_pos.y - viewport->y / gTileSize));
+
+  // Draw white tunnel, for one frame even if the frame shows several ticks
+  if (snapshot->white_tunnel_tick > state->drawn_tick) {
+    for (int y = 0; y < viewport->height; y++) {
+      for (int x = 0; x < viewport->width; x++) {
+        Tile tile = snapshot->tiles[viewport->y / gTileSize + y][viewport->x / gTileSize + x];
+        if (tile == TILE_EMPTY) {
+          draw_tile(draw_context, V2(300, 0), V2(x, y));
+        }
+      }
     }
+  }
 
-    // Move player
-    if (seconds_since(player_last_move_time) > kPlayerDelay) {
-      v2 next_player_pos = level->player_pos;
-
-      if (input.right) {
-        next_player_pos.x += 1;
-      } else if (input.left) {
-        next_player_pos.x -= 1;
-      } else if (input.up) {
-        next_player_pos.y -= 1;
-      } else if (input.down) {
-        next_player_pos.y += 1;
-      }
+  // Draw explosions
+  draw_explosions(snapshot->explosions, snapshot->tick, draw_context, viewport);
 
-      char next_tile = level->tiles[next_player_pos.y][next_player_pos.x];
-      if (can_move(level, next_player_pos)) {
-        if (next_tile == 'd') {
-          remove_obj(&level->diamonds, next_player_pos);
-          level->diamonds_collected += 1;
-          state->score += level->score_per_diamond;
-          if (level->diamonds_collected == level->min_diamonds) {
-            level->score_per_diamond = 20;
-            white_tunnel = true;
-            play_sound(SOUND_CRACK);
-
-            // Player can leave the level
-            for (int y = 0; y < LEVEL_HEIGHT; y++) {
-              for (int x = 0; x < LEVEL_WIDTH; x++) {
-                if (level->tiles[y][x] == 'X') {
-                  level->tiles[y][x] = 'x';
-                }
-              }
-            }
-          } else {
-            play_sound(SOUND_DIAMOND_COLLECT);
-          }
-        }
+  draw_status_bar(state, snapshot->status);
+  state->drawn_tick = snapshot->tick;
+}
 
-        // Level ends. Go to the next level.
-        if (next_tile == 'x') {
-          level->tiles[next_player_pos.y][next_player_pos.x] = 'N';
-          return LEVEL_ENDING;
-          continue;
-        }
+StateId leave_level_gameplay(GameState *state, StateId next) {
+  stop_sim_thread(&state->sim);
+  if (state->playback) {
+    return QUIT_GAME;  // only one attempt is stored in a replay
+  }
+  if (state->replay_file) {
+    replay_save(&state->replay, state->replay_file);
+  }
+  return next;
+}
 
-        SoundId walking_sound = SOUND_WALK_D;
-        if (next_tile == '.') {
-          walking_sound = SOUND_WALK_E;
-        }
-        if (walking_sound_cooldown-- == 0) {
-          play_sound(walking_sound);
-          walking_sound_cooldown = 1;
-        }
+void enter_level_ending(GameState *state) {
+  printf("level ending\n");
+  play_sound(SOUND_FINISHED);
+  stop_looped_sounds();
+  state->score_plus_time = 0;
+}
 
-        if (input.pickup) {
-          // Collect diamond or earth without moving with Ctrl
-          if (next_tile == 'd' || next_tile == '.') {
-            level->tiles[next_player_pos.y][next_player_pos.x] = '_';
-          }
-        } else {
-          // Move player
-          level->tiles[level->player_pos.y][level->player_pos.x] = '_';
-          level->tiles[next_player_pos.y][next_player_pos.x] = 'p';
-          level->player_pos = next_player_pos;
-        }
-        player_last_move_time = time_now();
-      }
+StateId update_level_ending(GameState *state, double dt) {
+  const double kScorePlusDelay = 0.02;
+  Level *level = &state->level;
 
-      // Push rock
-      if (next_tile == 'r' && can_move_rock(level, level->player_pos, next_player_pos)) {
-        if (!rock_is_pushed) {
-          rock_start_move_time = time_now();
-          rock_is_pushed = true;
-        } else if (seconds_since(rock_start_move_time) > 0.5f) {
-          int rock_next_x;
-          if (level->player_pos.x < next_player_pos.x) {
-            rock_next_x = next_player_pos.x + 1;
-          } else {
-            rock_next_x = next_player_pos.x - 1;
-          }
-
-          level->tiles[level->player_pos.y][level->player_pos.x] = '_';
-          level->tiles[next_player_pos.y][next_player_pos.x] = 'p';
-
-          for (int i = 0; i < level->rocks.num; i++) {
-            if (level->rocks.objects[i].pos.x == next_player_pos.x &&
-                level->rocks.objects[i].pos.y == next_player_pos.y) {
-              level->rocks.objects[i].pos.x = rock_next_x;
-              level->tiles[next_player_pos.y][rock_next_x] = 'r';
-              break;
-            }
-          }
-          level->player_pos = next_player_pos;
-        }
-      }
+  state->score_plus_time += dt;
+  if (state->score_plus_time > kScorePlusDelay) {
+    state->score_plus_time = 0;
+    level->time_left--;
+    state->score += 5;
+  }
 
-      if (level->player_pos.x == next_player_pos.x) {
-        rock_start_move_time = time_now();
-        rock_is_pushed = false;
-      }
-    }
+  if (state->state_time < 3.0 || level->time_left > 0) {
+    return LEVEL_ENDING;
+  }
+  if (state->level_id >= (COUNT(gLevels) - 1)) {
+    return YOU_WIN;
+  }
+  state->level_id++;
+  return LEVEL_STARTING;
+}
 
-    move_viewport(level, viewport, gTileSize);
+void render_level_ending(GameState *state) {
+  // The simulation is stopped, keep animating from where it left off
+  Level *level = &state->level;
+  update_animations(level->tick + (int)(state->state_time * SIM_TICKS_PER_SECOND));
+  draw_cached_level(level->tiles, &state->draw_context, &state->viewport);
+  draw_status_bar(state, get_status_bar(state));
+}
 
-    // Flooding
-    if (level->waters.num > 0 && seconds_since(flooding_last_time) > kFloodingDelay) {
-      flooding_last_time = time_now();
-      if (!play_sound_water) {  // turn on looped sound once
-        play_looped_sound(SOUND_AMOEBA);
-        play_sound_water = true;
-      }
+void enter_player_dying(GameState *state) {
+  stop_looped_sounds();
+}
 
-      bool expanded = false;
-      for (int i = 0; i < level->waters.num; i++) {
-        v2 water_pos = level->waters.pos[i];
-
-        v2 neighbours[4] = {
-            sum_v2(water_pos, V2(-1, 0)),
-            sum_v2(water_pos, V2(1, 0)),
-            sum_v2(water_pos, V2(0, -1)),
-            sum_v2(water_pos, V2(0, 1)),
-        };
-
-        for (int j = 0; j < 4; j++) {
-          v2 pos = neighbours[j];
-          if (out_of_bounds(pos)) continue;
-          char tile = level->tiles[pos.y][pos.x];
-          if (tile == '_' || tile == '.') {
-            add_water(level, pos.x, pos.y);
-            expanded = true;
-            break;
-          }
-        }
-        if (expanded) break;  // only add one tile of water at a time
-      }
-      if (!expanded) {
-        for (int i = 0; i < level->waters.num; i++) {
-          int x = level->waters.pos[i].x;
-          int y = level->waters.pos[i].y;
-          level->tiles[y][x] = 'd';
-          add_obj(&level->diamonds, V2(x, y));
-        }
-        level->waters.num = 0;  // disable flooding
-      }
-    }
+StateId update_player_dying(GameState *state, double dt) {
+  return state->state_time < 2.5 ? state->state_id : LEVEL_STARTING;
+}
 
-    // Move enemy
-    if (seconds_since(enemy_last_move_time) > kEnemyMoveDelay) {
-      enemy_last_move_time = time_now();
+void render_player_dying(GameState *state) {
+  // The simulation is stopped, keep animating from where it left off
+  Level *level = &state->level;
+  int tick = level->tick + (int)(state->state_time * SIM_TICKS_PER_SECOND);
+  update_animations(tick);
+  draw_cached_level(level->tiles, &state->draw_context, &state->viewport);
+  draw_explosions(level->explosions, tick, &state->draw_context, &state->viewport);
+  draw_status_bar(state, get_status_bar(state));
+}
 
-      bool player_killed = move_enemies(level, 'f') || move_enemies(level, 'b');
-      if (player_killed) {
-        return PLAYER_DYING;
-      }
-    }
+void enter_you_win(GameState *state) {
+  stop_looped_sounds();
+  play_sound(SOUND_BD1);
+  srand(time(NULL));
+}
 
-    // Drop rocks and diamonds
-    if (seconds_since(drop_last_time) > kDropDelay) {
-      drop_last_time = time_now();
-      if (drop_objects(level, 'r') || drop_objects(level, 'd')) {
-        return PLAYER_DYING;
-      }
+StateId update_you_win(GameState *state, double dt) {
+  return state->state_time <= 5.5 ? YOU_WIN : QUIT_GAME;
+}
 
-      // Clear locks
-      for (int i = 0; i < COUNT(level->locks); i++) {
-        Lock *lock = &level->locks[i];
-        if (lock->lifetime > 0) {
-          lock->lifetime--;
-          if (lock->lifetime == 0) {
-            if (level->tiles[lock->pos.y][lock->pos.x] == 'l') {
-              level->tiles[lock->pos.y][lock->pos.x] = '_';
-            }
-          }
-        }
-      }
-    }
+void render_you_win(GameState *state) {
+  // Display 'YOU WIN'
+  char msg[7] = "YOU WIN";
+  for (int i = 0; i < 7; i++) {
+    v2 pos_char = {gTileSize * (11 + i), 8 * gTileSize};
+    draw_char(&state->draw_context, pos_char, msg[i], false, COLOR_YELLOW);
+  }
+}
 
-    // Process active explosions
-    for (int i = 0; i < COUNT(level->explosions); ++i) {
-      Explosion *e = &level->explosions[i];
-      if (!e->active) continue;
-
-      if (seconds_since(e->start_time) > e->duration) {
-        e->active = false;
-        for (int y = e->area.top; y <= e->area.bottom; ++y) {
-          for (int x = e->area.left; x <= e->area.right; ++x) {
-            if (e->type == 'f') {
-              level->tiles[y][x] = '_';
-            } else if (e->type == 'b') {
-              level->tiles[y][x] = 'd';
-              add_obj(&level->diamonds, V2(x, y));
-            }
-          }
-        }
-      }
-    }
+Screen gScreens[QUIT_GAME] = {
+    // START_GAME
+    {enter_start_game, update_start_game, render_start_game, NULL, PACING_EVENTS},
+    // LEVEL_STARTING
+    {enter_level_starting, update_level_starting, render_level_starting, NULL, PACING_DISPLAY},
+    // LEVEL_GAMEPLAY
+    {enter_level_gameplay, update_level_gameplay, render_level_gameplay, leave_level_gameplay,
+     PACING_DISPLAY},
+    // LEVEL_ENDING
+    {enter_level_ending, update_level_ending, render_level_ending, NULL, PACING_SIM_RATE},
+    // PLAYER_DYING
+    {enter_player_dying, update_player_dying, render_player_dying, NULL, PACING_SIM_RATE},
+    // OUT_OF_TIME, looks the same as dying
+    {enter_player_dying, update_player_dying, render_player_dying, NULL, PACING_SIM_RATE},
+    // YOU_WIN
+    {enter_you_win, update_you_win, render_you_win, NULL, PACING_EVENTS},
+};
 
-    // Choose player animation
-    if (seconds_since(player_last_move_time) > 5) {
-      if (seconds_since(player_last_move_time) > 10) {
-        player_animation = ANIM_IDLE3;
-      } else {
-        player_animation = ANIM_IDLE2;
-      }
-    } else if (input.right) {
-      player_animation = ANIM_GO_RIGHT;
-      previos_direction_anim = ANIM_GO_RIGHT;
-    } else if (input.left) {
-      player_animation = ANIM_GO_LEFT;
-      previos_direction_anim = ANIM_GO_LEFT;
-    } else if (input.up || input.down) {
-      player_animation = previos_direction_anim;
-    } else {
-      player_animation = ANIM_IDLE1;
-    }
+void enter_state(GameState *state, StateId state_id) {
+  state->state_id = state_id;
+  state->state_time = 0;
+  state->input = (Input){};
+  gScreenDirty = true;
+  if (state_id != QUIT_GAME) {
+    gScreens[state_id].enter(state);
+  }
+}
 
-    // Check if time for running magic wall is over
-    if (level->magic_wall.is_on && seconds_since(level->magic_wall.start_time) > 30) {
-      stop_magic_wall(level);
-    }
+// Owns input, frame pacing and presentation for every state
+void run_main_loop(GameState *state) {
+  clock_skip(&gClock);
+  u64 next_frame = gClock.now;
+  while (state->state_id != QUIT_GAME) {
+    Screen *screen = &gScreens[state->state_id];
 
-    // Draw level
-    draw_level(level->tiles, draw_context, viewport);
-
-    // Draw player
-    draw_tile(draw_context, get_frame(player_animation),
-              V2(level->player_pos.x - viewport->x / gTileSize,
-                 level->player_pos.y - viewport->y / gTileSize));
-
-    // Draw white tunnel
-    if (white_tunnel) {
-      for (int y = 0; y < viewport->height; y++) {
-        for (int x = 0; x < viewport->width; x++) {
-          char tile_type = level->tiles[viewport->y / gTileSize + y][viewport->x / gTileSize + x];
-          if (tile_type == '_') {
-            draw_tile(draw_context, V2(300, 0), V2(x, y));
-          }
+    switch (screen->pacing) {
+      case PACING_DISPLAY: {
+        wait_for_next_frame(&next_frame, gFramePeriod, state);
+      } break;
+      case PACING_SIM_RATE: {
+        wait_for_next_frame(&next_frame, 1.0 / SIM_TICKS_PER_SECOND, state);
+      } break;
+      case PACING_EVENTS: {
+        if (!gScreenDirty) {
+          wait_for_events(&state->input, gClock.now + clock_ticks(&gClock, kIdleWakeup));
         }
-      }
+      } break;
     }
 
-    // Draw explosions
-    draw_explosions(level->explosions, draw_context, viewport);
+    // The only place the time is sampled during a frame, everything below uses dt or gClock.now
+    clock_tick(&gClock);
+    double dt = gClock.dt;
+    state->state_time += dt;
 
-    // Time left
-    level->time_left = level_time - (int)(seconds_since(start));
-
-    // Time is over
-    if (level->time_left < 10 && level->time_left >= 0) {
-      SoundId next_sound_out_of_time = SOUND_TIMEOUT_9 - level->time_left + 1;
-      if (next_sound_out_of_time != sound_out_of_time) {  // new sound every new second
-        play_sound(next_sound_out_of_time);
-        sound_out_of_time = next_sound_out_of_time;
+    StateId next = state->input.quit ? QUIT_GAME : screen->update(state, dt);
+    if (next != state->state_id) {
+      if (screen->leave) {
+        next = screen->leave(state, next);
       }
-    } else if (level->time_left < 0) {
-      level->time_left = 0;
-      return OUT_OF_TIME;
+      enter_state(state, next);
+      clock_skip(&gClock);  // the first dt of a state doesn't include entering it
+      continue;
     }
 
-    draw_status_bar(state);
-    update_screen(draw_context, state->level_id);
-
-    // {
-    //     u64 now = time_now();
-    //     double elapsed_ms = (double)(now - start) * 1000 /
-    //     gPerformanceFrequency; start = now; printf("MS %.3lf \n",
-    //     elapsed_ms);
-    // }
+    if (screen->pacing != PACING_EVENTS || gScreenDirty) {
+      screen->render(state);
+      update_screen(&state->draw_context, state->level_id);
+      gScreenDirty = false;
+    }
   }
-
-  return QUIT_GAME;
 }
 
-SDL_Texture *load_texture(char *filename, SDL_Renderer *renderer) {
-  SDL_Texture *texture;
-  int width, height, num_channels;
-  void *pixels = stbi_load(filename, &width, &height, &num_channels, 0);
+// Job, runs without touching SDL
+void decode_image(void *data) {
+  Image *image = data;
+  image->pixels =
+      stbi_load(image->filename, &image->width, &image->height, &image->num_channels, 0);
+}
 
-  SDL_Rect rect = {0, 0, width, height};
+SDL_Texture *create_texture(Image *image, SDL_Renderer *renderer) {
+  if (image->pixels == NULL) {
+    printf("Couldn't load %s\n", image->filename);
+    return NULL;
+  }
 
-  texture =
-      SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STATIC, width, height);
+  SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24,
+                                           SDL_TEXTUREACCESS_STATIC, image->width, image->height);
   if (texture == NULL) {
     printf("Couldn't create texture: %s\n", SDL_GetError());
     return NULL;
   }
 
-  int result = SDL_UpdateTexture(texture, &rect, pixels,
-                                 width * num_channels);  // load to video memory
-
-  if (result != 0) {
+  // Load to video memory
+  if (SDL_UpdateTexture(texture, NULL, image->pixels, image->width * image->num_channels) != 0) {
     printf("Couldn't update texture: %s\n", SDL_GetError());
     return NULL;
   }
 
+  stbi_image_free(image->pixels);
+  image->pixels = NULL;
   return texture;
 }
 
-int main() {
-  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_JOYSTICK | SDL_INIT_AUDIO) < 0) {
-    return 1;
+int main(int argc, char **argv) {
+  clock_start(&gClock, SDL_GetPerformanceCounter, SDL_GetPerformanceFrequency());
+
+  // Persistent game state
+  GameState state = {};
+  state.score = 0;
+  state.level_id = 15;
+  state.state_id = START_GAME;
+
+  MixKernel mix_kernel = MIX_KERNEL_COUNT;  // fastest one by default
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--record") == 0) {
+      state.replay_file = argv[i + 1];
+    } else if (strcmp(argv[i], "--replay") == 0) {
+      if (!replay_load(&state.replay, argv[i + 1])) {
+        return 1;
+      }
+      state.playback = true;
+      state.level_id = state.replay.level_id;
+      state.state_id = LEVEL_STARTING;
+    } else if (strcmp(argv[i], "--seek") == 0) {
+      state.seek_tick = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--virtual-fps") == 0) {
+      // Every frame is 1/fps seconds long no matter how long it really took, so a replay plays
+      // the same frames on every run
+      double fps = atof(argv[i + 1]);
+      if (fps <= 0) {
+        printf("Invalid --virtual-fps %s\n", argv[i + 1]);
+        return 1;
+      }
+      clock_start_virtual(&gClock, 1 / fps);
+    } else if (strcmp(argv[i], "--voices") == 0) {
+      set_voice_limit(atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "--mix") == 0) {
+      mix_kernel = mix_kernel_from_name(argv[i + 1]);
+      if (mix_kernel == MIX_KERNEL_COUNT) {
+        printf("Unknown mix kernel %s\n", argv[i + 1]);
+        return 1;
+      }
+    }
   }
-  gPerformanceFrequency = (double)SDL_GetPerformanceFrequency();
 
-  // Audio
-  SDL_AudioDeviceID audio_device_id = init_audio();
-  if (audio_device_id == 0) {
-    printf("Couldn't init audio\n");
+  // Decode sounds and images on worker threads while SDL opens the window, only the uploads to the
+  // audio device and the GPU are left for this thread
+  static JobBatch loader;
+  add_sound_jobs(&loader);
+  gSpriteSheet.filename = "bd-sprites.png";
+  add_job(&loader, decode_sprite_sheet, &gSpriteSheet);
+  Image logo = {"BD-logo.png"};
+  add_job(&loader, decode_image, &logo);
+  start_jobs(&loader);
+
+  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_JOYSTICK | SDL_INIT_AUDIO) < 0) {
     return 1;
   }
 
@@ -1551,23 +1485,42 @@ int main() {
   int window_width, window_height;
   SDL_GetWindowSize(window, &window_width, &window_height);
 
-  SDL_Renderer *renderer =
-      SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+  SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
   if (renderer == NULL) {
     printf("Couldn't create renderer: %s\n", SDL_GetError());
     return 1;
   }
 
+  // No vsync, run_main_loop() paces the frames to the display itself
+  SDL_DisplayMode display_mode;
+  int display = SDL_GetWindowDisplayIndex(window);
+  if (display < 0 || SDL_GetCurrentDisplayMode(display, &display_mode) != 0 ||
+      display_mode.refresh_rate <= 0) {
+    display_mode.refresh_rate = 60;  // unknown, assume the usual
+  }
+  gFramePeriod = 1.0 / display_mode.refresh_rate;
+
+  finish_jobs(&loader);
+
+  // Audio
+  init_mixer();
+  if (mix_kernel != MIX_KERNEL_COUNT && !set_mix_kernel(mix_kernel)) {
+    printf("Mix kernel %s isn't supported, using %s\n", gMixKernelNames[mix_kernel],
+           gMixKernelNames[gMixKernel]);
+  }
+  SDL_AudioDeviceID audio_device_id = init_audio();
+  if (audio_device_id == 0) {
+    printf("Couldn't init audio\n");
+    return 1;
+  }
+
   // Load textures
-  SDL_Texture *texture = load_texture("bd-sprites.png", renderer);
-  gBackColorTextures[BG_NORMAL] = texture;
-  gBackColorTextures[BG_BLUE] = load_texture("bd-sprites-blue.png", renderer);
-  gBackColorTextures[BG_GREEN] = load_texture("bd-sprites-green.png", renderer);
-  gBackColorTextures[BG_RED] = load_texture("bd-sprites-red.png", renderer);
-  gBackColorTextures[BG_SKY] = load_texture("bd-sprites-sky.png", renderer);
-  gBackColorTextures[BG_VIOLET] = load_texture("bd-sprites-violet.png", renderer);
+  if (!upload_sprite_sheet(&gSpriteSheet, renderer)) {
+    return 1;
+  }
+  SDL_Texture *texture = gSpriteSheet.texture;
 
-  SDL_Texture *logo_texture = load_texture("BD-logo.png", renderer);
+  SDL_Texture *logo_texture = create_texture(&logo, renderer);
 
   Viewport viewport;
   viewport.width = 30;
@@ -1593,47 +1546,12 @@ int main() {
   DrawContext draw_context = {renderer, texture, window_offset};
   DrawContext logo_draw_context = {renderer, logo_texture, window_offset};
 
-  // Persistent game state
-  GameState state = {};
-  state.score = 0;
-  state.level_id = 15;
   state.draw_context = draw_context;
+  state.logo_draw_context = logo_draw_context;
   state.viewport = viewport;
-  state.state_id = START_GAME;
 
-  bool is_running = true;
-  while (is_running) {
-    switch (state.state_id) {
-      case START_GAME: {
-        state.state_id = start_game(&state, &logo_draw_context);
-      } break;
-      case LEVEL_STARTING: {
-        state.state_id = level_starting(&state);
-      } break;
-      case LEVEL_GAMEPLAY: {
-        state.state_id = level_gameplay(&state);
-      } break;
-      case LEVEL_ENDING: {
-        printf("level ending\n");
-        state.state_id = level_ending(&state);
-      } break;
-      case PLAYER_DYING: {
-        state.state_id = player_dying(&state);
-      } break;
-      case OUT_OF_TIME: {
-        state.state_id = out_of_time(&state);
-      } break;
-      case QUIT_GAME: {
-        is_running = false;
-      } break;
-      case YOU_WIN: {
-        you_win(&state);
-        is_running = false;
-      } break;
-      default:
-        break;
-    }
-  }
+  enter_state(&state, state.state_id);
+  run_main_loop(&state);
 
   SDL_CloseAudioDevice(audio_device_id);
   SDL_DestroyWindow(window);
@@ -0,0 +1,177 @@
+#include "mix.h"
+
+#include <SDL2/SDL.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIX_X86
+#include <immintrin.h>
+#endif
+
+char *gMixKernelNames[MIX_KERNEL_COUNT] = {"scalar", "sse2", "avx2", "sdl"};
+
+MixKernel gMixKernel = MIX_KERNEL_SCALAR;
+
+// ===== Kernels =====
+// A sample is scaled as (sample * volume) >> 7, which keeps it unchanged at MIX_MAX_VOLUME. The
+// SIMD kernels widen the products to 32 bits, so every volume gives the same result as the scalar
+// loop, and handle the frames that don't fill a whole register with it.
+
+void mix_scalar(short *dst, const short *src, int len_frames, int channels, int volume) {
+  for (int i = 0; i < len_frames * 2; i++) {
+    int sample = dst[i] + ((src[i * channels / 2] * volume) >> 7);
+    if (sample > 32767) sample = 32767;
+    if (sample < -32768) sample = -32768;
+    dst[i] = (short)sample;
+  }
+}
+
+#ifdef MIX_X86
+__attribute__((target("sse2"))) static inline __m128i scale_sse2(__m128i s, __m128i volume) {
+  __m128i lo = _mm_mullo_epi16(s, volume);
+  __m128i hi = _mm_mulhi_epi16(s, volume);
+  __m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 7);
+  __m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 7);
+  return _mm_packs_epi32(p0, p1);
+}
+
+__attribute__((target("sse2"))) void mix_sse2(short *dst, const short *src, int len_frames,
+                                               int channels, int volume) {
+  bool full_volume = volume == MIX_MAX_VOLUME;
+  __m128i v = _mm_set1_epi16((short)volume);
+  int i = 0;  // in frames
+  if (channels == 2) {
+    for (; i + 4 <= len_frames; i += 4) {
+      __m128i s = _mm_loadu_si128((__m128i *)(src + 2 * i));
+      if (!full_volume) s = scale_sse2(s, v);
+      __m128i d = _mm_loadu_si128((__m128i *)(dst + 2 * i));
+      _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_adds_epi16(d, s));
+    }
+  } else {
+    // Every mono sample goes to both channels of its frame
+    for (; i + 8 <= len_frames; i += 8) {
+      __m128i s = _mm_loadu_si128((__m128i *)(src + i));
+      if (!full_volume) s = scale_sse2(s, v);
+      __m128i d0 = _mm_loadu_si128((__m128i *)(dst + 2 * i));
+      __m128i d1 = _mm_loadu_si128((__m128i *)(dst + 2 * i + 8));
+      _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_adds_epi16(d0, _mm_unpacklo_epi16(s, s)));
+      _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_adds_epi16(d1, _mm_unpackhi_epi16(s, s)));
+    }
+  }
+  mix_scalar(dst + 2 * i, src + channels * i, len_frames - i, channels, volume);
+}
+
+// Unpack and pack work within each 128-bit lane, so scaling keeps the samples in order
+__attribute__((target("avx2"))) static inline __m256i scale_avx2(__m256i s, __m256i volume) {
+  __m256i lo = _mm256_mullo_epi16(s, volume);
+  __m256i hi = _mm256_mulhi_epi16(s, volume);
+  __m256i p0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 7);
+  __m256i p1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 7);
+  return _mm256_packs_epi32(p0, p1);
+}
+
+__attribute__((target("avx2"))) void mix_avx2(short *dst, const short *src, int len_frames,
+                                               int channels, int volume) {
+  bool full_volume = volume == MIX_MAX_VOLUME;
+  __m256i v = _mm256_set1_epi16((short)volume);
+  int i = 0;  // in frames
+  if (channels == 2) {
+    for (; i + 8 <= len_frames; i += 8) {
+      __m256i s = _mm256_loadu_si256((__m256i *)(src + 2 * i));
+      if (!full_volume) s = scale_avx2(s, v);
+      __m256i d = _mm256_loadu_si256((__m256i *)(dst + 2 * i));
+      _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_adds_epi16(d, s));
+    }
+  } else {
+    for (; i + 16 <= len_frames; i += 16) {
+      __m256i s = _mm256_loadu_si256((__m256i *)(src + i));
+      if (!full_volume) s = scale_avx2(s, v);
+      // Put samples 0-3 and 4-7 in the low halves of the lanes, so that unpacking within the
+      // lanes duplicates samples 0-7 in order, and 8-15 for the high halves
+      s = _mm256_permute4x64_epi64(s, 0xD8);
+      __m256i d0 = _mm256_loadu_si256((__m256i *)(dst + 2 * i));
+      __m256i d1 = _mm256_loadu_si256((__m256i *)(dst + 2 * i + 16));
+      _mm256_storeu_si256((__m256i *)(dst + 2 * i),
+                          _mm256_adds_epi16(d0, _mm256_unpacklo_epi16(s, s)));
+      _mm256_storeu_si256((__m256i *)(dst + 2 * i + 16),
+                          _mm256_adds_epi16(d1, _mm256_unpackhi_epi16(s, s)));
+    }
+  }
+  mix_scalar(dst + 2 * i, src + channels * i, len_frames - i, channels, volume);
+}
+#endif
+
+void mix_sdl(short *dst, const short *src, int len_frames, int channels, int volume) {
+  if (channels == 2) {
+    SDL_MixAudioFormat((u8 *)dst, (const u8 *)src, AUDIO_S16, len_frames * 2 * sizeof(short),
+                       volume);
+    return;
+  }
+
+  // SDL can't upmix, so mono samples are duplicated into a stereo buffer first
+  short stereo[1024];
+  while (len_frames > 0) {
+    int chunk = len_frames < COUNT(stereo) / 2 ? len_frames : COUNT(stereo) / 2;
+    for (int i = 0; i < chunk; i++) {
+      stereo[2 * i] = src[i];
+      stereo[2 * i + 1] = src[i];
+    }
+    SDL_MixAudioFormat((u8 *)dst, (const u8 *)stereo, AUDIO_S16, chunk * 2 * sizeof(short),
+                       volume);
+    dst += 2 * chunk;
+    src += chunk;
+    len_frames -= chunk;
+  }
+}
+
+// ===== Selection =====
+
+// NULL if the kernel isn't built for this CPU architecture
+MixFunction *get_mix_function(MixKernel kernel) {
+  switch (kernel) {
+    case MIX_KERNEL_SCALAR:
+      return mix_scalar;
+#ifdef MIX_X86
+    case MIX_KERNEL_SSE2:
+      return mix_sse2;
+    case MIX_KERNEL_AVX2:
+      return mix_avx2;
+#endif
+    case MIX_KERNEL_SDL:
+      return mix_sdl;
+    default:
+      return NULL;
+  }
+}
+
+static MixFunction *gMixFunction = mix_scalar;
+
+bool set_mix_kernel(MixKernel kernel) {
+  MixFunction *function = get_mix_function(kernel);
+  if (function == NULL) return false;
+  if (kernel == MIX_KERNEL_SSE2 && !SDL_HasSSE2()) return false;
+  if (kernel == MIX_KERNEL_AVX2 && !SDL_HasAVX2()) return false;
+
+  gMixKernel = kernel;
+  gMixFunction = function;
+  return true;
+}
+
+void init_mixer() {
+  if (!set_mix_kernel(MIX_KERNEL_AVX2) && !set_mix_kernel(MIX_KERNEL_SSE2)) {
+    set_mix_kernel(MIX_KERNEL_SCALAR);
+  }
+}
+
+MixKernel mix_kernel_from_name(char *name) {
+  for (int i = 0; i < MIX_KERNEL_COUNT; i++) {
+    if (strcmp(name, gMixKernelNames[i]) == 0) {
+      return (MixKernel)i;
+    }
+  }
+  return MIX_KERNEL_COUNT;
+}
+
+void mix_samples(short *dst, const short *src, int len_frames, int channels, int volume) {
+  gMixFunction(dst, src, len_frames, channels, volume);
+}
@@ -0,0 +1,109 @@
+// Audio mixing microbenchmark. Mixes 1, 8, 32 and 128 voices of stereo and mono sounds into one
+// callback buffer with every kernel the CPU supports and prints CSV, one row per kernel, channel
+// count and voice count:
+//
+//   kernel,channels,voices,callbacks,ns_per_callback,ns_per_voice,min_ns,median_ns
+//
+// A callback is the same work audio_callback() does: clear 2048 stereo frames and mix each voice
+// into them. Half of the voices play at full volume and half at half volume, like one-shot and
+// looped sounds. Before timing, every kernel's output is checked against the scalar one.
+//
+// Usage: boulder-dash-mixbench [callbacks]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mix.h"
+
+#define CALLBACK_FRAMES 2048
+#define SOUND_SAMPLES (44100 * 2)
+#define MAX_VOICES 128
+
+static short gOutput[CALLBACK_FRAMES * 2];
+static short gExpected[CALLBACK_FRAMES * 2];
+static short *gSoundSamples[MAX_VOICES];
+
+u64 now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+int compare_u32(const void *a, const void *b) {
+  u32 x = *(u32 *)a;
+  u32 y = *(u32 *)b;
+  return (x > y) - (x < y);
+}
+
+// Every voice reads its own sound at its own position, so the sources don't all stay in cache
+void mix_callback(MixFunction *mix, int num_voices, int channels, int callback) {
+  memset(gOutput, 0, sizeof(gOutput));
+  int len_frames = SOUND_SAMPLES / channels;
+  for (int i = 0; i < num_voices; i++) {
+    int position = (callback * CALLBACK_FRAMES + i * 512) % (len_frames - CALLBACK_FRAMES);
+    int volume = i % 2 ? MIX_MAX_VOLUME / 2 : MIX_MAX_VOLUME;
+    mix(gOutput, gSoundSamples[i] + position * channels, CALLBACK_FRAMES, channels, volume);
+  }
+}
+
+int main(int argc, char **argv) {
+  int num_callbacks = 2000;
+  if (argc > 1) num_callbacks = atoi(argv[1]);
+  if (num_callbacks <= 0) return 1;
+
+  // Loud noise, so that plenty of samples saturate
+  srand(1);
+  for (int i = 0; i < MAX_VOICES; i++) {
+    gSoundSamples[i] = malloc(SOUND_SAMPLES * sizeof(short));
+    for (int j = 0; j < SOUND_SAMPLES; j++) {
+      gSoundSamples[i][j] = (short)(rand() % 65536 - 32768);
+    }
+  }
+
+  u32 *samples = malloc(num_callbacks * sizeof(u32));
+  int voice_counts[] = {1, 8, 32, 128};
+
+  printf("kernel,channels,voices,callbacks,ns_per_callback,ns_per_voice,min_ns,median_ns\n");
+  for (int kernel = 0; kernel < MIX_KERNEL_COUNT; kernel++) {
+    if (!set_mix_kernel((MixKernel)kernel)) {
+      fprintf(stderr, "%s: not supported, skipped\n", gMixKernelNames[kernel]);
+      continue;
+    }
+    MixFunction *mix = get_mix_function((MixKernel)kernel);
+
+    for (int channels = 2; channels >= 1; channels--) {
+      for (int v = 0; v < COUNT(voice_counts); v++) {
+        int num_voices = voice_counts[v];
+
+        // SDL rounds differently, see MixFunction
+        if (kernel != MIX_KERNEL_SDL) {
+          mix_callback(get_mix_function(MIX_KERNEL_SCALAR), num_voices, channels, 0);
+          memcpy(gExpected, gOutput, sizeof(gOutput));
+          mix_callback(mix, num_voices, channels, 0);
+          if (memcmp(gExpected, gOutput, sizeof(gOutput)) != 0) {
+            fprintf(stderr, "%s: output differs from scalar with %d voices of %d channels\n",
+                    gMixKernelNames[kernel], num_voices, channels);
+            return 1;
+          }
+        }
+
+        u64 total = 0;
+        for (int i = 0; i < num_callbacks; i++) {
+          u64 start = now_ns();
+          mix_callback(mix, num_voices, channels, i);
+          samples[i] = (u32)(now_ns() - start);
+          total += samples[i];
+        }
+
+        qsort(samples, num_callbacks, sizeof(*samples), compare_u32);
+        double ns_per_callback = (double)total / num_callbacks;
+        printf("%s,%d,%d,%d,%.1f,%.1f,%u,%u\n", gMixKernelNames[kernel], channels, num_voices,
+               num_callbacks, ns_per_callback, ns_per_callback / num_voices, samples[0],
+               samples[num_callbacks / 2]);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,222 @@
+#include "replay.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const u32 kReplayVersion = 1;
+const int kKeyframeInterval = 10 * SIM_TICKS_PER_SECOND;
+
+enum {
+  INPUT_RIGHT = 1 << 0,
+  INPUT_LEFT = 1 << 1,
+  INPUT_UP = 1 << 2,
+  INPUT_DOWN = 1 << 3,
+  INPUT_PICKUP = 1 << 4,
+};
+
+// Only the keys the simulation looks at are stored
+u8 pack_input(Input input) {
+  u8 packed = 0;
+  if (input.right) packed |= INPUT_RIGHT;
+  if (input.left) packed |= INPUT_LEFT;
+  if (input.up) packed |= INPUT_UP;
+  if (input.down) packed |= INPUT_DOWN;
+  if (input.pickup) packed |= INPUT_PICKUP;
+  return packed;
+}
+
+Input unpack_input(u8 packed) {
+  Input input = {};
+  input.right = (packed & INPUT_RIGHT) != 0;
+  input.left = (packed & INPUT_LEFT) != 0;
+  input.up = (packed & INPUT_UP) != 0;
+  input.down = (packed & INPUT_DOWN) != 0;
+  input.pickup = (packed & INPUT_PICKUP) != 0;
+  return input;
+}
+
+u32 hash_tiles(Tiles tiles) {
+  u32 hash = 2166136261u;  // FNV-1a
+  u8 *bytes = (u8 *)tiles;
+  for (int i = 0; i < LEVEL_HEIGHT * LEVEL_WIDTH; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+
+void replay_reserve(Replay *replay, int num_ticks) {
+  if (num_ticks <= replay->capacity) return;
+
+  int capacity = replay->capacity > 0 ? replay->capacity : 60 * SIM_TICKS_PER_SECOND;
+  while (capacity < num_ticks) {
+    capacity = capacity > INT_MAX / 2 ? num_ticks : capacity * 2;
+  }
+  replay->inputs = realloc(replay->inputs, capacity * sizeof(*replay->inputs));
+  replay->checksums = realloc(replay->checksums, capacity * sizeof(*replay->checksums));
+  assert(replay->inputs && replay->checksums);
+  replay->capacity = capacity;
+}
+
+void replay_reserve_keyframes(Replay *replay, int num_keyframes) {
+  if (num_keyframes <= replay->keyframe_capacity) return;
+
+  int capacity = replay->keyframe_capacity > 0 ? replay->keyframe_capacity : 16;
+  while (capacity < num_keyframes) {
+    capacity = capacity > INT_MAX / 2 ? num_keyframes : capacity * 2;
+  }
+  replay->keyframes = realloc(replay->keyframes, capacity * sizeof(*replay->keyframes));
+  assert(replay->keyframes);
+  replay->keyframe_capacity = capacity;
+}
+
+void replay_start(Replay *replay, int level_id, u32 seed, Level *level) {
+  replay->level_id = level_id;
+  replay->seed = seed;
+  replay->num_ticks = 0;
+  replay->keyframe_interval = kKeyframeInterval;
+  replay_reserve_keyframes(replay, 1);
+  replay->keyframes[0] = *level;
+  replay->num_keyframes = 1;
+}
+
+void replay_record(Replay *replay, Input input, Level *level) {
+  assert(level->tick == replay->num_ticks + 1);
+  replay_reserve(replay, replay->num_ticks + 1);
+  replay->inputs[replay->num_ticks] = pack_input(input);
+  replay->checksums[replay->num_ticks] = hash_tiles(level->tiles);
+  replay->num_ticks++;
+
+  if (level->tick % replay->keyframe_interval == 0) {
+    assert(level->tick / replay->keyframe_interval == replay->num_keyframes);
+    replay_reserve_keyframes(replay, replay->num_keyframes + 1);
+    replay->keyframes[replay->num_keyframes++] = *level;
+  }
+}
+
+Input replay_input(Replay *replay, int tick) {
+  Input input = {};
+  if (tick >= 0 && tick < replay->num_ticks) {
+    input = unpack_input(replay->inputs[tick]);
+  }
+  return input;
+}
+
+bool replay_check(Replay *replay, int tick, Level *level) {
+  if (tick < 0 || tick >= replay->num_ticks) return true;
+  return replay->checksums[tick] == hash_tiles(level->tiles);
+}
+
+bool replay_seek(Replay *replay, Level *level, int tick) {
+  if (tick < 0 || tick > replay->num_ticks) return false;
+
+  int keyframe = tick / replay->keyframe_interval;
+  if (keyframe >= replay->num_keyframes) {
+    keyframe = replay->num_keyframes - 1;
+  }
+  *level = replay->keyframes[keyframe];
+
+  while (level->tick < tick) {
+    SimEvents events = {};
+    sim_step(level, replay_input(replay, level->tick), &events);
+  }
+  return true;
+}
+
+bool replay_save(Replay *replay, char *file_name) {
+  FILE *file = fopen(file_name, "wb");
+  if (file == NULL) {
+    printf("Couldn't open %s for writing\n", file_name);
+    return false;
+  }
+
+  ReplayHeader header = {};
+  memcpy(header.magic, "BDRP", 4);
+  header.version = kReplayVersion;
+  header.level_id = replay->level_id;
+  header.seed = replay->seed;
+  header.num_ticks = replay->num_ticks;
+  header.level_size = sizeof(Level);
+  header.keyframe_interval = replay->keyframe_interval;
+  header.num_keyframes = replay->num_keyframes;
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(replay->inputs, sizeof(*replay->inputs), replay->num_ticks, file) ==
+                replay->num_ticks &&
+            fwrite(replay->checksums, sizeof(*replay->checksums), replay->num_ticks, file) ==
+                replay->num_ticks &&
+            fwrite(replay->keyframes, sizeof(*replay->keyframes), replay->num_keyframes, file) ==
+                replay->num_keyframes;
+  fclose(file);
+
+  if (!ok) {
+    printf("Couldn't write replay %s\n", file_name);
+  }
+  return ok;
+}
+
+bool replay_load(Replay *replay, char *file_name) {
+  FILE *file = fopen(file_name, "rb");
+  if (file == NULL) {
+    printf("Couldn't open replay %s\n", file_name);
+    return false;
+  }
+
+  ReplayHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "BDRP", 4) != 0 ||
+      header.version != kReplayVersion || header.level_id >= COUNT(gLevels) ||
+      header.level_size != sizeof(Level) || header.keyframe_interval == 0 ||
+      header.num_keyframes == 0) {
+    printf("%s is not a valid replay\n", file_name);
+    fclose(file);
+    return false;
+  }
+
+  // The counts decide how much is allocated, so they have to match what is actually in the file
+  long data_start = ftell(file);
+  fseek(file, 0, SEEK_END);
+  long data_end = ftell(file);
+  fseek(file, data_start, SEEK_SET);
+  u64 data_size = (u64)header.num_ticks * (sizeof(*replay->inputs) + sizeof(*replay->checksums)) +
+                  (u64)header.num_keyframes * sizeof(*replay->keyframes);
+  if (header.num_ticks > INT_MAX || header.num_keyframes > INT_MAX ||
+      header.num_keyframes != header.num_ticks / header.keyframe_interval + 1 || data_start < 0 ||
+      data_end < data_start || data_size != (u64)(data_end - data_start)) {
+    printf("%s is truncated or corrupt\n", file_name);
+    fclose(file);
+    return false;
+  }
+
+  replay->level_id = header.level_id;
+  replay->seed = header.seed;
+  replay->keyframe_interval = header.keyframe_interval;
+  replay->num_ticks = 0;
+  replay->num_keyframes = 0;
+  replay_reserve(replay, header.num_ticks);
+  replay_reserve_keyframes(replay, header.num_keyframes);
+  bool ok = fread(replay->inputs, sizeof(*replay->inputs), header.num_ticks, file) ==
+                header.num_ticks &&
+            fread(replay->checksums, sizeof(*replay->checksums), header.num_ticks, file) ==
+                header.num_ticks &&
+            fread(replay->keyframes, sizeof(*replay->keyframes), header.num_keyframes, file) ==
+                header.num_keyframes;
+  fclose(file);
+
+  if (!ok) {
+    printf("Replay %s is truncated\n", file_name);
+    return false;
+  }
+  replay->num_ticks = header.num_ticks;
+  replay->num_keyframes = header.num_keyframes;
+  return true;
+}
+
+void replay_free(Replay *replay) {
+  free(replay->inputs);
+  free(replay->checksums);
+  free(replay->keyframes);
+  memset(replay, 0, sizeof(*replay));
+}
@@ -0,0 +1,1020 @@
+#include "sim.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "levels.h"
+
+// All delays are in ticks, see SIM_TICKS_PER_SECOND
+const int kPlayerDelay = 6;           // 0.1 s
+const int kRockPushDelay = 30;        // 0.5 s
+const int kMagicWallDuration = 1800;  // 30 s
+
+// Subsystems that run on a fixed schedule, on every tick that is a multiple of their period. Ticks
+// are counted from load_level(), so what runs on a tick only depends on the tick number.
+const int kDropPeriod = 10;      // 0.17 s
+const int kEnemyPeriod = 10;     // 0.17 s
+const int kFloodingPeriod = 76;  // 1.27 s
+
+static inline bool tick_is_due(Level *level, int period) {
+  return level->tick % period == 0;
+}
+
+#ifdef SIM_PROFILE
+#define TIMED_BEGIN(subsystem) u64 timed_start_##subsystem = sim_profile_now()
+#define TIMED_END(subsystem) \
+  sim_profile_record(subsystem, sim_profile_now() - timed_start_##subsystem)
+#else
+#define TIMED_BEGIN(subsystem)
+#define TIMED_END(subsystem)
+#endif
+
+Physics gPhysics = PHYSICS_ACTIVE_SET;
+
+// ======================================= Events ==================================================
+
+// A sound is played once per tick however many objects ask for it, copies starting together would
+// only sound louder
+void sim_play_sound(SimEvents *events, SoundId sound_id) {
+  for (int i = 0; i < events->num_sounds; i++) {
+    if (events->sounds[i] == sound_id) return;
+  }
+  if (events->num_sounds < COUNT(events->sounds)) {
+    events->sounds[events->num_sounds++] = sound_id;
+  }
+}
+
+void sim_play_looped_sound(SimEvents *events, SoundId sound_id) {
+  assert(events->num_looped_sounds < COUNT(events->looped_sounds));
+  events->looped_sounds[events->num_looped_sounds++] = sound_id;
+}
+
+void sim_stop_looped_sounds(SimEvents *events) {
+  events->stop_looped_sounds = true;
+  events->num_looped_sounds = 0;  // stopping also cancels anything started earlier this tick
+}
+
+// ======================================= Level ===================================================
+
+// clang-format off
+TileInfo gTileInfo[TILE_TYPE_COUNT] = {
+    {'_', TILE_MASK_EMPTY, TILE_PLAYER_CAN_ENTER | TILE_ENEMY_CAN_ENTER},  // TILE_EMPTY
+    {'.', TILE_MASK_OTHER, TILE_PLAYER_CAN_ENTER | TILE_GROUND},           // TILE_DIRT
+    {'w', TILE_MASK_WALL, TILE_ROUNDED | TILE_GROUND},                     // TILE_WALL
+    {'W', TILE_MASK_OTHER, TILE_GROUND},                                   // TILE_STEEL_WALL
+    {'r', TILE_MASK_ROCK, TILE_ROUNDED | TILE_HEAVY},                      // TILE_ROCK
+    {'d', TILE_MASK_DIAMOND, TILE_PLAYER_CAN_ENTER | TILE_ROUNDED | TILE_HEAVY},  // TILE_DIAMOND
+    {'p', TILE_MASK_TRAP, TILE_ENEMY_CAN_ENTER},                           // TILE_PLAYER
+    {'f', TILE_MASK_ENEMY, 0},                                             // TILE_ENEMY
+    {'b', TILE_MASK_ENEMY, 0},                                             // TILE_BUTTERFLY
+    {'a', TILE_MASK_OTHER, TILE_ENEMY_CAN_ENTER},                          // TILE_WATER
+    {'m', TILE_MASK_TRAP, 0},                                              // TILE_MAGIC_WALL
+    {'M', TILE_MASK_TRAP, 0},                                              // TILE_MAGIC_WALL_ON
+    {'l', TILE_MASK_LOCK, TILE_HEAVY},                                     // TILE_LOCK
+    {'X', TILE_MASK_OTHER, 0},                                             // TILE_EXIT_CLOSED
+    {'x', TILE_MASK_OTHER, TILE_PLAYER_CAN_ENTER},                         // TILE_EXIT
+    {'E', TILE_MASK_OTHER, 0},                                             // TILE_ENTRANCE
+    {'S', TILE_MASK_OTHER, 0},                                             // TILE_PLAYER_APPEARING
+    {'N', TILE_MASK_OTHER, 0},                                             // TILE_PLAYER_EXITED
+    {'!', TILE_MASK_OTHER, 0},                                             // TILE_EXPLOSION
+    {'L', TILE_MASK_OTHER, 0},                                             // TILE_LOADING
+    {'*', TILE_MASK_OTHER, 0},                                             // TILE_HIDDEN
+    {'?', TILE_MASK_OTHER, 0},                                             // TILE_UNKNOWN
+};
+// clang-format on
+
+Tile tile_from_symbol(char symbol) {
+  for (int tile = 0; tile < TILE_UNKNOWN; tile++) {
+    if (gTileInfo[tile].symbol == symbol) {
+      return tile;
+    }
+  }
+  return TILE_UNKNOWN;
+}
+
+void wake_obj(Objects *objs, int i) {
+  objs->awake[i / 64] |= 1ull << (i % 64);
+}
+
+void sleep_obj(Objects *objs, int i) {
+  objs->awake[i / 64] &= ~(1ull << (i % 64));
+}
+
+bool obj_is_awake(Objects *objs, int i) {
+  return (objs->awake[i / 64] >> (i % 64)) & 1;
+}
+
+// Index of the first awake object at or after i, -1 if there is none
+int next_awake_obj(Objects *objs, int i) {
+  for (int word = i / 64; word * 64 < objs->num; word++) {
+    u64 bits = objs->awake[word];
+    if (word == i / 64) {
+      bits &= ~0ull << (i % 64);
+    }
+    if (bits) {
+      int next = word * 64 + __builtin_ctzll(bits);
+      return next < objs->num ? next : -1;
+    }
+  }
+  return -1;
+}
+
+// Wake up the rocks and diamonds that look at the tile: the ones above, below, to the sides and
+// diagonally above it
+void wake_around(Level *level, int x, int y) {
+  v2 readers[7] = {
+      V2(x, y), V2(x, y - 1), V2(x, y + 1), V2(x - 1, y), V2(x + 1, y), V2(x - 1, y - 1),
+      V2(x + 1, y - 1),
+  };
+  for (int j = 0; j < COUNT(readers); j++) {
+    v2 pos = readers[j];
+    if (pos.x < 0 || pos.x >= LEVEL_WIDTH || pos.y < 0 || pos.y >= LEVEL_HEIGHT) continue;
+    if (level->rocks.slots[pos.y][pos.x]) {
+      wake_obj(&level->rocks, level->rocks.slots[pos.y][pos.x] - 1);
+    }
+    if (level->diamonds.slots[pos.y][pos.x]) {
+      wake_obj(&level->diamonds, level->diamonds.slots[pos.y][pos.x] - 1);
+    }
+  }
+}
+
+void set_tile(Level *level, int x, int y, Tile tile) {
+  level->tile_masks[gTileInfo[level->tiles[y][x]].mask][y] &= ~(1ull << x);
+  level->tiles[y][x] = tile;
+  level->tile_masks[gTileInfo[tile].mask][y] |= 1ull << x;
+  wake_around(level, x, y);
+}
+
+void add_water(Level *level, int x, int y) {
+  level->waters.pos[level->waters.num].x = x;
+  level->waters.pos[level->waters.num].y = y;
+  level->waters.num++;
+  level->waters.slots[y][x] = level->waters.num;
+  set_tile(level, x, y, TILE_WATER);
+}
+
+void add_enemy(Enemies *enemies, v2 pos, v2 direction) {
+  enemies->objects[enemies->num].pos = pos;
+  enemies->objects[enemies->num].direction = direction;
+  enemies->num++;
+  enemies->slots[pos.y][pos.x] = enemies->num;
+  assert(enemies->num < COUNT(enemies->objects));
+}
+
+void add_obj(Objects *objs, v2 pos) {
+  objs->objects[objs->num].pos = pos;
+  objs->objects[objs->num++].falling = false;
+  objs->slots[pos.y][pos.x] = objs->num;
+  objs->falling[pos.y] &= ~(1ull << pos.x);
+  wake_obj(objs, objs->num - 1);
+  assert(objs->num < COUNT(objs->objects));
+}
+
+void load_level(Level *level, int num_level) {
+  memset(level, 0, sizeof(*level));
+
+  level->magic_wall.num = 0;
+  level->magic_wall.is_on = false;
+
+  char *cave = gLevels[num_level];
+  for (int y = 0; y < LEVEL_HEIGHT; ++y) {
+    for (int x = 0; x < LEVEL_WIDTH; ++x) {
+      Tile tile = tile_from_symbol(cave[y * LEVEL_WIDTH + x]);
+      level->tiles[y][x] = tile;
+      level->tile_masks[gTileInfo[tile].mask][y] |= 1ull << x;
+
+      if (level->tiles[y][x] == TILE_ENTRANCE) {
+        level->player_pos.x = x;
+        level->player_pos.y = y;
+      }
+
+      if (level->tiles[y][x] == TILE_ENEMY) {
+        add_enemy(&level->enemies, V2(x, y), V2(1, 0));  // to the right
+      }
+
+      if (level->tiles[y][x] == TILE_BUTTERFLY) {
+        add_enemy(&level->butterflies, V2(x, y), V2(1, 0));  // to the right
+      }
+
+      if (level->tiles[y][x] == TILE_ROCK) {
+        add_obj(&level->rocks, V2(x, y));
+      }
+
+      if (level->tiles[y][x] == TILE_DIAMOND) {
+        add_obj(&level->diamonds, V2(x, y));
+      }
+
+      if (level->tiles[y][x] == TILE_WATER) {
+        add_water(level, x, y);
+      }
+
+      if (level->tiles[y][x] == TILE_MAGIC_WALL) {
+        level->magic_wall.bricks[level->magic_wall.num].x = x;
+        level->magic_wall.bricks[level->magic_wall.num].y = y;
+        level->magic_wall.num++;
+      }
+    }
+  }
+
+  level->time_left = 150;
+  level->level_time = level->time_left;
+  level->score_per_diamond = 10;
+  level->min_diamonds = gLevel_min_diamonds[num_level];
+  level->diamonds_collected = 0;
+  level->walking_sound_cooldown = 1;
+  level->sound_out_of_time = SOUND_TIMEOUT_9;
+}
+
+void sim_start_level(Level *level) {
+  set_tile(level, level->player_pos.x, level->player_pos.y, TILE_PLAYER_APPEARING);
+}
+
+v2 turn_right(v2 direction) {
+  return V2(-direction.y, direction.x);
+}
+
+v2 turn_left(v2 direction) {
+  return V2(direction.y, -direction.x);
+}
+
+bool out_of_bounds(v2 pos) {
+  return (pos.x < 0 || pos.x >= LEVEL_WIDTH || pos.y < 0 || pos.y >= LEVEL_HEIGHT);
+}
+
+bool can_move(Level *level, v2 pos) {
+  if (out_of_bounds(pos)) {
+    return false;
+  }
+  return tile_is(level->tiles[pos.y][pos.x], TILE_PLAYER_CAN_ENTER);
+}
+
+bool enemy_can_move(Level *level, v2 pos) {
+  if (out_of_bounds(pos)) {
+    return false;
+  }
+  return tile_is(level->tiles[pos.y][pos.x], TILE_ENEMY_CAN_ENTER);
+}
+
+// Index of the object at pos, -1 if there is none
+int find_obj(Objects *objs, v2 pos) {
+  return objs->slots[pos.y][pos.x] - 1;
+}
+
+void move_obj(Objects *objs, int i, v2 pos) {
+  v2 *old_pos = &objs->objects[i].pos;
+  if (objs->slots[old_pos->y][old_pos->x] == i + 1) {
+    objs->slots[old_pos->y][old_pos->x] = 0;
+  }
+  if (objs->objects[i].falling) {
+    objs->falling[old_pos->y] &= ~(1ull << old_pos->x);
+    objs->falling[pos.y] |= 1ull << pos.x;
+  }
+  *old_pos = pos;
+  objs->slots[pos.y][pos.x] = i + 1;
+}
+
+void set_falling(Objects *objs, int i, bool falling) {
+  Stone *stone = &objs->objects[i];
+  stone->falling = falling;
+  if (falling) {
+    objs->falling[stone->pos.y] |= 1ull << stone->pos.x;
+  } else {
+    objs->falling[stone->pos.y] &= ~(1ull << stone->pos.x);
+  }
+}
+
+void move_enemy(Enemies *enemies, int i, v2 pos) {
+  v2 *old_pos = &enemies->objects[i].pos;
+  if (enemies->slots[old_pos->y][old_pos->x] == i + 1) {
+    enemies->slots[old_pos->y][old_pos->x] = 0;
+  }
+  *old_pos = pos;
+  enemies->slots[pos.y][pos.x] = i + 1;
+}
+
+// Removal moves the last object into the freed slot
+void remove_enemy(Enemies *enemies, v2 pos) {
+  int i = enemies->slots[pos.y][pos.x] - 1;
+  if (i < 0) return;
+
+  int last = enemies->num - 1;
+  enemies->slots[pos.y][pos.x] = 0;
+  if (i != last) {
+    v2 pos_lst = enemies->objects[last].pos;
+    enemies->objects[i].pos = pos_lst;
+    enemies->slots[pos_lst.y][pos_lst.x] = i + 1;
+  }
+  enemies->num -= 1;
+}
+
+void remove_water(Waters *waters, v2 pos) {
+  int i = waters->slots[pos.y][pos.x] - 1;
+  if (i < 0) return;
+
+  int last = waters->num - 1;
+  waters->slots[pos.y][pos.x] = 0;
+  if (i != last) {
+    v2 pos_lst = waters->pos[last];
+    waters->pos[i] = pos_lst;
+    waters->slots[pos_lst.y][pos_lst.x] = i + 1;
+  }
+  waters->num -= 1;
+}
+
+void remove_obj(Objects *objs, v2 pos) {
+  int i = find_obj(objs, pos);
+  if (i < 0) return;
+
+  int last = objs->num - 1;
+  objs->slots[pos.y][pos.x] = 0;
+  objs->falling[pos.y] &= ~(1ull << pos.x);
+  sleep_obj(objs, i);
+  if (i != last) {
+    Stone stone_lst = objs->objects[last];
+    objs->objects[i] = stone_lst;
+    objs->slots[stone_lst.pos.y][stone_lst.pos.x] = i + 1;
+    if (obj_is_awake(objs, last)) {
+      wake_obj(objs, i);
+      sleep_obj(objs, last);
+    }
+  }
+  objs->num -= 1;
+}
+
+void stop_magic_wall(Level *level, SimEvents *events) {
+  for (int i = 0; i < level->magic_wall.num; i++) {  // 20 number of bricks for magic wall for level
+    set_tile(level, level->magic_wall.bricks[i].x, level->magic_wall.bricks[i].y, TILE_MAGIC_WALL);
+  }
+  level->magic_wall.start_tick = 0;
+  level->magic_wall.is_on = false;
+  sim_stop_looped_sounds(events);
+}
+
+void add_explosion(Level *level, v2 pos, Tile type) {
+  assert(type == TILE_ENEMY || type == TILE_BUTTERFLY || type == TILE_PLAYER);
+
+  v2 start = sum_v2(pos, V2(-1, -1));
+  v2 end = sum_v2(pos, V2(1, 1));
+
+  // Don't blow up the outer walls
+  if (start.x == 0) {
+    start.x++;
+    end.x++;
+  }
+  if (end.x == LEVEL_WIDTH - 1) {
+    start.x--;
+    end.x--;
+  }
+  if (start.y == 1) {
+    start.y++;
+    end.y++;
+  }
+  if (end.y == LEVEL_HEIGHT - 1) {
+    start.y--;
+    end.y--;
+  }
+
+  Rect area = create_rect(start.x, start.y, end.x, end.y);
+
+  // Remove objects and set tiles
+  for (int y = area.top; y <= area.bottom; ++y) {
+    for (int x = area.left; x <= area.right; ++x) {
+      Tile tile = level->tiles[y][x];
+      if (tile == TILE_ROCK) {
+        remove_obj(&level->rocks, V2(x, y));
+      } else if (tile == TILE_DIAMOND) {
+        remove_obj(&level->diamonds, V2(x, y));
+      } else if (tile == TILE_ENEMY) {
+        remove_enemy(&level->enemies, V2(x, y));
+      } else if (tile == TILE_BUTTERFLY) {
+        remove_enemy(&level->butterflies, V2(x, y));
+      } else if (tile == TILE_WATER) {
+        remove_water(&level->waters, V2(x, y));
+      }
+      set_tile(level, x, y, TILE_EXPLOSION);  // ignore this tile when draw
+    }
+  }
+
+  // Activate explosion
+  bool added = false;
+  for (int i = 0; i < COUNT(level->explosions); ++i) {
+    Explosion *explosion = &level->explosions[i];
+    if (explosion->active) continue;
+
+    explosion->active = true;
+    explosion->type = type;
+    explosion->area = area;
+    explosion->start_tick = level->tick;
+
+    if (type == TILE_ENEMY || type == TILE_PLAYER) {
+      explosion->duration = 16;  // NOTE: based on the animation, 4 frames at 15 fps
+    } else if (type == TILE_BUTTERFLY) {
+      explosion->duration = 28;  // NOTE: based on the animation, 7 frames at 15 fps
+    }
+    added = true;
+    break;
+  }
+  assert(added);
+}
+
+// Return True if enemy kills player
+bool move_enemies(Level *level, Tile obj_type, SimEvents *events) {
+  Enemies *enemies;
+
+  if (obj_type == TILE_ENEMY) {
+    enemies = &level->enemies;
+  } else if (obj_type == TILE_BUTTERFLY) {
+    enemies = &level->butterflies;
+  } else {
+    assert(!"Unknown obj type");
+  }
+
+  for (int i = 0; i < enemies->num; ++i) {
+    Enemy *enemy = &enemies->objects[i];
+
+    assert(level->tiles[enemy->pos.y][enemy->pos.x] == obj_type);
+    set_tile(level, enemy->pos.x, enemy->pos.y, TILE_EMPTY);  // "erase"
+
+    v2 pos_forward = sum_v2(enemy->pos, enemy->direction);
+    v2 pos_right = sum_v2(enemy->pos, turn_right(enemy->direction));
+    v2 pos_right_diag = sum_v2(pos_right, V2(-enemy->direction.x, -enemy->direction.y));
+    v2 prev_enemy_pos = enemy->pos;
+
+    if (enemy_can_move(level, pos_right) &&
+        level->tiles[pos_right_diag.y][pos_right_diag.x] != TILE_EMPTY) {
+      // Turn and move right
+      move_enemy(enemies, i, pos_right);
+      enemy->direction = turn_right(enemy->direction);
+    } else if (enemy_can_move(level, pos_forward)) {
+      // Move forward
+      move_enemy(enemies, i, pos_forward);
+    } else {
+      // Turn left in place
+      enemy->direction = turn_left(enemy->direction);
+    }
+
+    if (level->tiles[enemy->pos.y][enemy->pos.x] == TILE_PLAYER) {
+      sim_play_sound(events, SOUND_EXPLODED);
+      add_explosion(level, V2(enemy->pos.x, enemy->pos.y), TILE_PLAYER);
+      return true;
+    }
+
+    if (level->tiles[enemy->pos.y][enemy->pos.x] == TILE_WATER) {  // water collision
+      sim_play_sound(events, SOUND_EXPLODED);
+      move_enemy(enemies, i, prev_enemy_pos);  // do not move enemy to next position to explode it
+      set_tile(level, enemy->pos.x, enemy->pos.y, obj_type);
+      add_explosion(level, V2(enemy->pos.x, enemy->pos.y), obj_type);
+    } else {
+      set_tile(level, enemy->pos.x, enemy->pos.y, obj_type);  // "draw"
+    }
+  }
+
+  return false;
+}
+
+bool can_move_rock(Level *level, v2 pos, v2 next_pos) {
+  if (((pos.x < next_pos.x) && (level->tiles[pos.y][next_pos.x + 1] == TILE_EMPTY)) ||
+      ((pos.x > next_pos.x) && (level->tiles[pos.y][next_pos.x - 1] == TILE_EMPTY))) {
+    return true;
+  }
+  return false;
+}
+
+void add_lock(Lock *locks, int x, int y) {
+  for (int i = 0; i < sizeof(&locks); i++) {
+    if (locks[i].lifetime == 0) {
+      locks[i].lifetime = 2;
+      locks[i].pos.x = x;
+      locks[i].pos.y = y;
+      return;
+    }
+  }
+  assert(!"Not enough space for locks");
+}
+
+Objects *get_objects(Level *level, Tile obj_type) {
+  if (obj_type == TILE_DIAMOND) {
+    return &level->diamonds;
+  } else if (obj_type == TILE_ROCK) {
+    return &level->rocks;
+  }
+  assert(!"Unknown obj type");
+  return NULL;
+}
+
+// One step of the object with index i. Returns true if player is killed
+bool drop_object(Level *level, Objects *objs, int i, Tile obj_type, SimEvents *events,
+                 bool *play_fall_sound) {
+  Stone *stone = &objs->objects[i];
+  int x = stone->pos.x;
+  int y = stone->pos.y;
+  bool falling = stone->falling;
+
+  assert(level->tiles[y][x] == obj_type);
+
+  Tile tile_above = level->tiles[y - 1][x];
+  Tile tile_under = level->tiles[y + 1][x];
+
+  // A falling rock or diamond activate magic wall
+  if (tile_under == TILE_MAGIC_WALL && falling && !level->magic_wall.is_on) {
+    for (int j = 0; j < level->magic_wall.num; j++) {
+      v2 brick = level->magic_wall.bricks[j];
+      set_tile(level, brick.x, brick.y, TILE_MAGIC_WALL_ON);
+    }
+    level->magic_wall.start_tick = level->tick;
+    level->magic_wall.is_on = true;
+    sim_play_looped_sound(events, SOUND_MAGIC_WALL);
+    sim_play_sound(events, SOUND_DIAMOND_1);
+    tile_under = level->tiles[y + 1][x];
+  }
+
+  // Kill enemy
+  if (tile_under == TILE_ENEMY || tile_under == TILE_BUTTERFLY) {
+    sim_play_sound(events, SOUND_EXPLODED);
+    *play_fall_sound = true;
+    add_explosion(level, V2(x, y + 1), tile_under);
+  }
+
+  // Kill player
+  if (falling && tile_under == TILE_PLAYER) {
+    sim_play_sound(events, SOUND_EXPLODED);
+    *play_fall_sound = true;
+    add_explosion(level, V2(x, y + 1), tile_under);
+    return true;
+  }
+
+  // If there is space in the position below the magic wall then the rock/diamond morphs into a
+  // falling diamond/rock and moves down two positions, to be below the magic wall
+  if (tile_under == TILE_MAGIC_WALL_ON &&
+      (level->tiles[y + 2][x] == TILE_EMPTY || level->tiles[y + 2][x] == TILE_LOCK) && falling) {
+    move_obj(objs, i, V2(x, y + 2));
+    set_tile(level, x, y, TILE_EMPTY);
+
+    if (obj_type == TILE_ROCK) {  // if rock is falling
+      sim_play_sound(events, SOUND_DIAMOND_1);
+      remove_obj(&level->rocks, V2(x, y + 2));  // remove rock
+      add_obj(&level->diamonds, V2(x, y + 2));
+      set_tile(level, x, y + 2, TILE_DIAMOND);
+    } else if (obj_type == TILE_DIAMOND) {  // if diamond is falling
+      sim_play_sound(events, SOUND_STONE);
+      remove_obj(&level->diamonds, V2(x, y + 2));  // remove diamond
+      add_obj(&level->rocks, V2(x, y + 2));
+      set_tile(level, x, y + 2, TILE_ROCK);
+    }
+    return false;
+  }
+
+  if (tile_under == TILE_EMPTY) {
+    set_falling(objs, i, true);
+
+    // Drop down
+    set_tile(level, x, y, TILE_EMPTY);
+    set_tile(level, x, y + 1, obj_type);
+    move_obj(objs, i, V2(x, y + 1));
+
+    // Determine whether we play sound.
+    // Check every tile below and play sound only if falling on
+    // a steady ground or on a stack of boulders that are already
+    // on the ground
+    *play_fall_sound = true;  // in case we never enter the loop
+    for (int j = y + 2; j < LEVEL_HEIGHT; ++j) {
+      Tile tile = level->tiles[j][x];
+      if (tile == TILE_EMPTY) {
+        *play_fall_sound = false;  // the rock is still falling
+        break;
+      }
+      if (tile_is(tile, TILE_GROUND)) {
+        *play_fall_sound = true;
+        break;  // falling on solid ground.
+      }
+    }
+    return false;  // don't check if we can slide
+  } else {
+    set_falling(objs, i, false);
+  }
+
+  // Slide off rocks and diamonds
+  if (tile_is(tile_under, TILE_ROUNDED) && !tile_is(tile_above, TILE_HEAVY)) {
+    if (level->tiles[y][x - 1] == TILE_EMPTY && level->tiles[y + 1][x - 1] == TILE_EMPTY) {
+      // Drop left
+      set_tile(level, x, y, TILE_LOCK);
+      add_lock(level->locks, x, y);
+      set_tile(level, x - 1, y, obj_type);
+      move_obj(objs, i, V2(x - 1, y));
+      return false;
+    }
+    if (level->tiles[y][x + 1] == TILE_EMPTY && level->tiles[y + 1][x + 1] == TILE_EMPTY) {
+      // Drop right
+      set_tile(level, x, y, TILE_LOCK);
+      add_lock(level->locks, x, y);
+      set_tile(level, x + 1, y, obj_type);
+      move_obj(objs, i, V2(x + 1, y));
+      return false;
+    }
+  }
+
+  return false;
+}
+
+void play_drop_sound(Level *level, Tile obj_type, SimEvents *events) {
+  if (obj_type == TILE_ROCK) {
+    sim_play_sound(events, SOUND_STONE);
+  } else if (obj_type == TILE_DIAMOND) {
+    sim_play_sound(events, SOUND_DIAMOND_1 + level->diamond_sound_num);
+    level->diamond_sound_num = (level->diamond_sound_num + 1) % 7;
+  }
+}
+
+// Returns true if player is killed
+bool drop_objects(Level *level, Tile obj_type, SimEvents *events) {
+  bool play_fall_sound = false;
+  Objects *objs = get_objects(level, obj_type);
+
+  for (int i = 0; i < objs->num; i++) {
+    if (drop_object(level, objs, i, obj_type, events, &play_fall_sound)) {
+      return true;
+    }
+  }
+
+  if (play_fall_sound) {
+    play_drop_sound(level, obj_type, events);
+  }
+  return false;
+}
+
+// Same as drop_objects(), but skips the objects that are asleep. A sleeping object did nothing on
+// its last drop and none of the tiles it looks at changed since then, so it would do nothing again.
+// Objects woken up during the pass are stepped in the same pass if they come later in the array,
+// just like in drop_objects().
+bool drop_objects_awake(Level *level, Tile obj_type, SimEvents *events) {
+  bool play_fall_sound = false;
+  Objects *objs = get_objects(level, obj_type);
+
+  for (int i = next_awake_obj(objs, 0); i >= 0; i = next_awake_obj(objs, i + 1)) {
+    v2 pos = objs->objects[i].pos;
+    if (drop_object(level, objs, i, obj_type, events, &play_fall_sound)) {
+      return true;
+    }
+
+    // The object may have been removed and replaced by the last one
+    Stone *stone = &objs->objects[i];
+    if (i < objs->num && !stone->falling && stone->pos.x == pos.x && stone->pos.y == pos.y) {
+      sleep_obj(objs, i);
+    }
+  }
+
+  if (play_fall_sound) {
+    play_drop_sound(level, obj_type, events);
+  }
+  return false;
+}
+
+// Same as drop_objects(), but only steps the objects that are going to do something. Most objects
+// lie still, so whole rows are checked at once with the tile masks:
+//
+//   - an object falls if the tile under it is empty
+//   - it slides if it lies on a rock, diamond or wall, nothing heavy is above it, and the tiles
+//     to the side and diagonally below are empty
+//   - an object that was falling has to be stepped to clear its falling flag
+//
+// Objects are stepped in the same order as in drop_objects(), so every tile an active object
+// writes wakes up the objects that read it (the tiles above, below, to the sides and diagonally
+// above). The rare cases that touch more of the level (killing an enemy or the player, the magic
+// wall) are left to drop_objects().
+bool drop_objects_bitboard(Level *level, Tile obj_type, SimEvents *events) {
+  Objects *objs = get_objects(level, obj_type);
+  RowMask *masks = level->tile_masks;
+  TileMask own_mask = gTileInfo[obj_type].mask;
+
+  RowMask active = {};
+  bool any_active = false;
+  for (int y = 1; y < LEVEL_HEIGHT - 1; y++) {
+    u64 own = masks[own_mask][y];
+    if (!own) continue;
+
+    u64 enemy_under = masks[TILE_MASK_ENEMY][y + 1];
+    u64 trap_under = masks[TILE_MASK_TRAP][y + 1];
+    if (own & (enemy_under | (objs->falling[y] & trap_under))) {
+      return drop_objects(level, obj_type, events);
+    }
+
+    u64 empty = masks[TILE_MASK_EMPTY][y];
+    u64 empty_under = masks[TILE_MASK_EMPTY][y + 1];
+    u64 heavy_above = masks[TILE_MASK_ROCK][y - 1] | masks[TILE_MASK_DIAMOND][y - 1] |
+                      masks[TILE_MASK_LOCK][y - 1];
+    u64 rounded_under = masks[TILE_MASK_ROCK][y + 1] | masks[TILE_MASK_DIAMOND][y + 1] |
+                        masks[TILE_MASK_WALL][y + 1];
+    u64 side_free = empty & empty_under;
+
+    u64 fall = own & empty_under;
+    u64 slide = own & rounded_under & ~heavy_above & ((side_free << 1) | (side_free >> 1));
+    active[y] = fall | slide | objs->falling[y];
+    any_active |= active[y] != 0;
+  }
+  if (!any_active) return false;
+
+  // Wake up everything next to the tiles the active objects may write
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    RowMask writes = {};
+    for (int y = 1; y < LEVEL_HEIGHT - 1; y++) {
+      u64 a = active[y];
+      writes[y] |= a | (a << 1) | (a >> 1);
+      writes[y + 1] |= a;
+    }
+    for (int y = 1; y < LEVEL_HEIGHT - 1; y++) {
+      u64 w = writes[y];
+      u64 w_under = writes[y + 1];
+      u64 readers = masks[own_mask][y] & (writes[y - 1] | w_under | (w << 1) | (w >> 1) |
+                                          (w_under << 1) | (w_under >> 1));
+      if (readers & ~active[y]) {
+        active[y] |= readers;
+        changed = true;
+      }
+    }
+  }
+
+  // Gather in array order
+  int indices[COUNT(objs->objects)];
+  int num_indices = 0;
+  for (int y = 1; y < LEVEL_HEIGHT - 1; y++) {
+    for (u64 a = active[y]; a; a &= a - 1) {
+      int x = __builtin_ctzll(a);
+      int i = objs->slots[y][x] - 1;
+      assert(i >= 0);
+
+      int j = num_indices++;
+      for (; j > 0 && indices[j - 1] > i; j--) {
+        indices[j] = indices[j - 1];
+      }
+      indices[j] = i;
+    }
+  }
+
+  bool play_fall_sound = false;
+  for (int k = 0; k < num_indices; k++) {
+    if (drop_object(level, objs, indices[k], obj_type, events, &play_fall_sound)) {
+      return true;
+    }
+  }
+
+  if (play_fall_sound) {
+    play_drop_sound(level, obj_type, events);
+  }
+  return false;
+}
+
+// ======================================= Simulation ==============================================
+
+// Returns true if the player reached the exit
+bool move_player(Level *level, Input input, SimEvents *events) {
+  v2 next_player_pos = level->player_pos;
+
+  if (input.right) {
+    next_player_pos.x += 1;
+  } else if (input.left) {
+    next_player_pos.x -= 1;
+  } else if (input.up) {
+    next_player_pos.y -= 1;
+  } else if (input.down) {
+    next_player_pos.y += 1;
+  }
+
+  Tile next_tile = level->tiles[next_player_pos.y][next_player_pos.x];
+  if (can_move(level, next_player_pos)) {
+    if (next_tile == TILE_DIAMOND) {
+      remove_obj(&level->diamonds, next_player_pos);
+      level->diamonds_collected += 1;
+      events->score += level->score_per_diamond;
+      if (level->diamonds_collected == level->min_diamonds) {
+        level->score_per_diamond = 20;
+        events->white_tunnel = true;
+        sim_play_sound(events, SOUND_CRACK);
+
+        // Player can leave the level
+        for (int y = 0; y < LEVEL_HEIGHT; y++) {
+          for (int x = 0; x < LEVEL_WIDTH; x++) {
+            if (level->tiles[y][x] == TILE_EXIT_CLOSED) {
+              set_tile(level, x, y, TILE_EXIT);
+            }
+          }
+        }
+      } else {
+        sim_play_sound(events, SOUND_DIAMOND_COLLECT);
+      }
+    }
+
+    // Level ends. Go to the next level.
+    if (next_tile == TILE_EXIT) {
+      set_tile(level, next_player_pos.x, next_player_pos.y, TILE_PLAYER_EXITED);
+      return true;
+    }
+
+    SoundId walking_sound = SOUND_WALK_D;
+    if (next_tile == TILE_DIRT) {
+      walking_sound = SOUND_WALK_E;
+    }
+    if (level->walking_sound_cooldown-- == 0) {
+      sim_play_sound(events, walking_sound);
+      level->walking_sound_cooldown = 1;
+    }
+
+    if (input.pickup) {
+      // Collect diamond or earth without moving with Ctrl
+      if (next_tile == TILE_DIAMOND || next_tile == TILE_DIRT) {
+        set_tile(level, next_player_pos.x, next_player_pos.y, TILE_EMPTY);
+      }
+    } else {
+      // Move player
+      set_tile(level, level->player_pos.x, level->player_pos.y, TILE_EMPTY);
+      set_tile(level, next_player_pos.x, next_player_pos.y, TILE_PLAYER);
+      level->player_pos = next_player_pos;
+    }
+    level->player_last_move_tick = level->tick;
+  }
+
+  // Push rock
+  if (next_tile == TILE_ROCK && can_move_rock(level, level->player_pos, next_player_pos)) {
+    if (!level->rock_is_pushed) {
+      level->rock_start_move_tick = level->tick;
+      level->rock_is_pushed = true;
+    } else if (level->tick - level->rock_start_move_tick > kRockPushDelay) {
+      int rock_next_x;
+      if (level->player_pos.x < next_player_pos.x) {
+        rock_next_x = next_player_pos.x + 1;
+      } else {
+        rock_next_x = next_player_pos.x - 1;
+      }
+
+      set_tile(level, level->player_pos.x, level->player_pos.y, TILE_EMPTY);
+      set_tile(level, next_player_pos.x, next_player_pos.y, TILE_PLAYER);
+
+      int rock = find_obj(&level->rocks, next_player_pos);
+      if (rock >= 0) {
+        move_obj(&level->rocks, rock, V2(rock_next_x, next_player_pos.y));
+        set_tile(level, rock_next_x, next_player_pos.y, TILE_ROCK);
+      }
+      level->player_pos = next_player_pos;
+    }
+  }
+
+  if (level->player_pos.x == next_player_pos.x) {
+    level->rock_start_move_tick = level->tick;
+    level->rock_is_pushed = false;
+  }
+
+  return false;
+}
+
+void flood(Level *level, SimEvents *events) {
+  if (!level->flooding_sound_on) {  // turn on looped sound once
+    sim_play_looped_sound(events, SOUND_AMOEBA);
+    level->flooding_sound_on = true;
+  }
+
+  bool expanded = false;
+  for (int i = 0; i < level->waters.num; i++) {
+    v2 water_pos = level->waters.pos[i];
+
+    v2 neighbours[4] = {
+        sum_v2(water_pos, V2(-1, 0)),
+        sum_v2(water_pos, V2(1, 0)),
+        sum_v2(water_pos, V2(0, -1)),
+        sum_v2(water_pos, V2(0, 1)),
+    };
+
+    for (int j = 0; j < 4; j++) {
+      v2 pos = neighbours[j];
+      if (out_of_bounds(pos)) continue;
+      Tile tile = level->tiles[pos.y][pos.x];
+      if (tile == TILE_EMPTY || tile == TILE_DIRT) {
+        add_water(level, pos.x, pos.y);
+        expanded = true;
+        break;
+      }
+    }
+    if (expanded) break;  // only add one tile of water at a time
+  }
+  if (!expanded) {
+    for (int i = 0; i < level->waters.num; i++) {
+      int x = level->waters.pos[i].x;
+      int y = level->waters.pos[i].y;
+      level->waters.slots[y][x] = 0;
+      set_tile(level, x, y, TILE_DIAMOND);
+      add_obj(&level->diamonds, V2(x, y));
+    }
+    level->waters.num = 0;  // disable flooding
+  }
+}
+
+SimOutcome sim_step(Level *level, Input input, SimEvents *events) {
+  level->tick++;
+
+  // Move player
+  if (level->tick - level->player_last_move_tick > kPlayerDelay) {
+    TIMED_BEGIN(SUBSYSTEM_PLAYER);
+    bool level_complete = move_player(level, input, events);
+    TIMED_END(SUBSYSTEM_PLAYER);
+    if (level_complete) {
+      return SIM_LEVEL_COMPLETE;
+    }
+  }
+
+  // Flooding
+  if (level->waters.num > 0 && tick_is_due(level, kFloodingPeriod)) {
+    TIMED_BEGIN(SUBSYSTEM_FLOODING);
+    flood(level, events);
+    TIMED_END(SUBSYSTEM_FLOODING);
+  }
+
+  // Move enemy
+  if (tick_is_due(level, kEnemyPeriod)) {
+    TIMED_BEGIN(SUBSYSTEM_ENEMIES);
+    bool player_killed =
+        move_enemies(level, TILE_ENEMY, events) || move_enemies(level, TILE_BUTTERFLY, events);
+    TIMED_END(SUBSYSTEM_ENEMIES);
+    if (player_killed) {
+      return SIM_PLAYER_DIED;
+    }
+  }
+
+  // Drop rocks and diamonds
+  if (tick_is_due(level, kDropPeriod)) {
+    TIMED_BEGIN(SUBSYSTEM_DROP);
+    bool player_killed;
+    if (gPhysics == PHYSICS_ACTIVE_SET) {
+      player_killed = drop_objects_awake(level, TILE_ROCK, events) ||
+                      drop_objects_awake(level, TILE_DIAMOND, events);
+    } else if (gPhysics == PHYSICS_BITBOARD) {
+      player_killed = drop_objects_bitboard(level, TILE_ROCK, events) ||
+                      drop_objects_bitboard(level, TILE_DIAMOND, events);
+    } else {
+      player_killed =
+          drop_objects(level, TILE_ROCK, events) || drop_objects(level, TILE_DIAMOND, events);
+    }
+    if (player_killed) {
+      TIMED_END(SUBSYSTEM_DROP);
+      return SIM_PLAYER_DIED;
+    }
+
+    // Clear locks
+    for (int i = 0; i < COUNT(level->locks); i++) {
+      Lock *lock = &level->locks[i];
+      if (lock->lifetime > 0) {
+        lock->lifetime--;
+        if (lock->lifetime == 0) {
+          if (level->tiles[lock->pos.y][lock->pos.x] == TILE_LOCK) {
+            set_tile(level, lock->pos.x, lock->pos.y, TILE_EMPTY);
+          }
+        }
+      }
+    }
+    TIMED_END(SUBSYSTEM_DROP);
+  }
+
+  // Process active explosions
+  TIMED_BEGIN(SUBSYSTEM_EXPLOSIONS);
+  for (int i = 0; i < COUNT(level->explosions); ++i) {
+    Explosion *e = &level->explosions[i];
+    if (!e->active) continue;
+
+    if (level->tick - e->start_tick > e->duration) {
+      e->active = false;
+      for (int y = e->area.top; y <= e->area.bottom; ++y) {
+        for (int x = e->area.left; x <= e->area.right; ++x) {
+          if (e->type == TILE_ENEMY) {
+            set_tile(level, x, y, TILE_EMPTY);
+          } else if (e->type == TILE_BUTTERFLY) {
+            set_tile(level, x, y, TILE_DIAMOND);
+            add_obj(&level->diamonds, V2(x, y));
+          }
+        }
+      }
+    }
+  }
+  TIMED_END(SUBSYSTEM_EXPLOSIONS);
+
+  // Check if time for running magic wall is over
+  if (level->magic_wall.is_on && level->tick - level->magic_wall.start_tick > kMagicWallDuration) {
+    stop_magic_wall(level, events);
+  }
+
+  // Time left
+  level->time_left = level->level_time - level->tick / SIM_TICKS_PER_SECOND;
+
+  // Time is over
+  if (level->time_left < 10 && level->time_left >= 0) {
+    SoundId next_sound_out_of_time = SOUND_TIMEOUT_9 - level->time_left + 1;
+    if (next_sound_out_of_time != level->sound_out_of_time) {  // new sound every new second
+      sim_play_sound(events, next_sound_out_of_time);
+      level->sound_out_of_time = next_sound_out_of_time;
+    }
+  } else if (level->time_left < 0) {
+    level->time_left = 0;
+    return SIM_OUT_OF_TIME;
+  }
+
+  return SIM_RUNNING;
+}